@@ -0,0 +1,304 @@
+#pragma once
+
+#include <cstdint>
+
+#include "gear.hpp"
+#include "devices.hpp"
+#include "pitch.hpp"
+
+// Output axes following the same encoder. TIM1 has two free compare channels:
+// the forward one (CC3, TRGO) gets the nearest jump on the side the primary
+// axis moves to and starts the step timers armed for it without the ISR; the
+// other one (CC4) gets the nearest jump on the other side, those steps are
+// made by a manual trigger from the ISR. When the axes agree on direction
+// (the usual case) every regular step of every axis is a hardware triggered
+// one. Per event, only the axes stepping at that count compute a new jump.
+//
+// Jumps are on the extended (32 bit) position. A compare further than
+// `reach` is not placed on the 16 bit counter, a waypoint `reach` counts away
+// is placed instead (no timer is armed for it). Reaching a waypoint costs one
+// interrupt per `reach` counts and places the compare again, so the jump
+// length is not limited by the counter.
+namespace axes {
+
+  using gear::Count;
+
+  template <typename Gear, typename StepGen>
+  struct Axis {
+    using gear = Gear;
+    using step_gen = StepGen;
+
+    enum class Event : uint8_t {
+      none,
+      step,        // started by the forward compare
+      manual_step, // same direction, needs a manual trigger
+      reversal     // direction change, needs a manual trigger
+    };
+
+    volatile inline static bool enabled = false;
+    inline static bool armed = false; // timer triggered by the forward compare
+    inline static Event event = Event::none;
+    inline static bool queued = false; // event made by a backlash burst
+
+    // Output position as of the last event (its pulse may still be in flight),
+    // set when the gear is engaged
+    inline static int32_t position = 0;
+    // Constant of the gear line (see monitor.hpp), set when engaged
+    inline static int64_t line = 0;
+
+    // Microstep switching: pulses become `requested_step` output steps long
+    // at the first event where the position is a multiple of `align` (any
+    // event when back to single steps). The step interrupt counts in the new
+    // size (and sets the driver) once the pulse in flight is done.
+    volatile inline static int requested_step = 1;
+    volatile inline static int requested_align = 1;
+    volatile inline static bool step_changed = false;
+    inline static int pulse_step = 1; // output steps of the pulses being counted
+
+    static void request_step(int step, int align) {
+      requested_align = align;
+      requested_step = step;
+    }
+
+    // Ratio change (feed override): requested when none is pending, taken at
+    // the next event. The error is scaled to the new denominator, so the
+    // output does not move, and the line starts again from there. Not for
+    // threads, the phase is not kept.
+    volatile inline static int requested_n = 0, requested_d = 0;
+    volatile inline static bool ratio_changed = false;
+
+    static bool request_ratio(int n, int d) {
+      if (ratio_changed) {
+        return false;
+      }
+      requested_n = n;
+      requested_d = d;
+      ratio_changed = true;
+      return true;
+    }
+
+    // Pitch error compensation (see pitch.hpp): reaching the point above
+    // moves the line by its sign, leaving the one below in reverse moves it
+    // back. `correction` is the sum at the position. Only the two points are
+    // compared per event, the index moves when one is crossed.
+    inline static const pitch::Map* pitch_map = nullptr;
+    inline static int point = 0; // index of the point above
+    inline static pitch::Point point_above = pitch::Map::none_above;
+    inline static pitch::Point point_below = pitch::Map::none_below;
+    inline static int32_t correction = 0;
+
+    // Reversal hysteresis (encoder counts): the reverse compare is placed
+    // this much further back, so a spindle dithering on a step boundary does
+    // not flip the direction every count. The late reversal takes the jump as
+    // computed and adds the counts since, so the gear owes no error. Not with
+    // a profile or cam (the slope may change over those counts).
+    inline static int32_t hysteresis = 0;
+
+    // Steps found lost (motor encoder): requested by the main loop, made up
+    // from the next event on (the line moves, the position drops back), the
+    // step interrupt takes them off the output position. One writer each.
+    volatile inline static int32_t lost_requested = 0, lost_taken = 0, lost_counted = 0;
+
+    // Before engaging at `output` (CC interrupt disabled)
+    static void load_correction(int32_t output) {
+      if (pitch_map == nullptr) {
+        point_above = pitch::Map::none_above;
+        point_below = pitch::Map::none_below;
+        correction = 0;
+        return;
+      }
+      point = pitch_map->index_above(output);
+      point_above = pitch_map->at(point);
+      point_below = pitch_map->at(point - 1);
+      correction = pitch_map->offset(output);
+    }
+
+    // The jump on the given side of the count of the last event
+    static inline Count jump_on(bool reverse_side) {
+      return (step_gen::get_direction() == reverse_side) ? gear::range.next.count : reversal_count();
+    }
+
+    static inline Count reversal_count() {
+      const Count at = gear::range.prev.count;
+      if (hysteresis == 0 || gear::profile.index < gear::profile.size || gear::cam.size > 0) {
+        return at;
+      }
+      return step_gen::get_direction() ? (at + hysteresis) : (at - hysteresis);
+    }
+
+    // Not while a backlash burst runs, the trigger is off until the gear
+    // arms it again after the burst
+    static inline void arm(bool on) {
+      armed = on && !step_gen::is_compensating();
+      step_gen::set_triggered(armed);
+    }
+
+    // Direction is changed right away, before the manual trigger
+    static inline bool begin_event(Count count, bool fwd_compare) {
+      event = Event::none;
+      if (!enabled) {
+        return false;
+      }
+      auto& r = gear::range;
+      if (r.next.count == count) {
+        event = (fwd_compare && armed) ? Event::step : Event::manual_step;
+      }
+      else if (reversal_count() == count) {
+        event = Event::reversal;
+      }
+      else {
+        return false;
+      }
+      queued = step_gen::is_compensating();
+      if (queued) {
+        step_gen::queue_step(event == Event::reversal);
+        return false;
+      }
+      if (event == Event::reversal) {
+        step_gen::change_direction(!step_gen::get_direction());
+      }
+      return needs_trigger();
+    }
+
+    static inline bool needs_trigger() {
+      return !queued && ((event == Event::manual_step) || (event == Event::reversal));
+    }
+
+    // Jumps are taken from the event count, not the (possibly later) counter
+    static inline void end_event(Count count) {
+      if (event == Event::none) {
+        return;
+      }
+      auto& r = gear::range;
+      const bool dir = step_gen::get_direction();
+      if (event == Event::reversal) {
+        const Count at = r.prev.count;
+        gear::take(r.prev);
+        gear::state.err = gear::state.err + gear::state.N * ::gear::distance(at, count);
+      }
+      else {
+        gear::take(r.next);
+      }
+      const int step = gear::state.step;
+      position += dir ? -step : step;
+      if (lost_requested != lost_taken) {
+        const int32_t lost = lost_requested - lost_taken;
+        lost_taken = lost_requested;
+        gear::state.err = gear::state.err + lost * gear::state.D;
+        position -= lost;
+      }
+      if (!dir && position >= point_above.at && position - step < point_above.at) {
+        move_line(point_above.sign);
+        point_below = point_above;
+        point_above = pitch_map->at(++point);
+      }
+      else if (dir && position < point_below.at && position + step >= point_below.at) {
+        move_line(-point_below.sign);
+        point_above = point_below;
+        point_below = pitch_map->at(--point - 1);
+      }
+      if (ratio_changed && gear::profile.index == gear::profile.size && gear::cam.size == 0) {
+        const int d = requested_d;
+        gear::state.err = static_cast<int>(int64_t(gear::state.err) * d / gear::state.D);
+        gear::state.N = requested_n;
+        gear::state.D = d;
+        line = int64_t(requested_n) * static_cast<int32_t>(count) -
+                int64_t(d) * (position - correction) - gear::state.err;
+        ratio_changed = false;
+      }
+      if (switches_step()) {
+        gear::state.step = requested_step;
+        step_changed = true;
+      }
+      r.next_jump(dir, count);
+      if (event == Event::step) {
+        step_gen::set_delay(gear::phase_delay(
+                devices::encoder_pulse_duration::last_duration(), r.next.error, step_gen::max_delay));
+      }
+      else if (event == Event::reversal && !queued) {
+        step_gen::compensate();
+      }
+    }
+
+  private:
+    static inline void move_line(int steps) {
+      gear::state.err = gear::state.err + steps * gear::state.D;
+      correction += steps;
+    }
+
+    static inline bool switches_step() {
+      const int step = requested_step;
+      if (step == gear::state.step || step_changed ||
+          gear::profile.index < gear::profile.size || gear::cam.size > 0) {
+        return false;
+      }
+      return (step == 1) || (position % requested_align == 0);
+    }
+
+  public:
+  };
+
+  template <typename... Axes>
+  struct Group {
+    static constexpr uint32_t reach = 0x7FFF; // below half of the counter range
+
+    // Compares are placed relative to `count`, the last event or the current
+    // position. Called from the CC ISR or with the CC interrupt disabled.
+    static void update_channels(Count count) {
+      using devices::encoder;
+      const bool side = primary_direction();
+      const Count fwd = nearest(side, count);
+      const Count rev = nearest(!side, count);
+      (Axes::arm(Axes::enabled && (Axes::step_gen::get_direction() == side) &&
+                 (Axes::gear::range.next.count == fwd)), ...);
+      encoder::update_channels(static_cast<encoder::CounterValue>(fwd),
+                               static_cast<encoder::CounterValue>(rev));
+    }
+
+    static void process_cc_interrupt() {
+      using devices::encoder;
+      const bool fwd = encoder::is_cc_fwd_interrupt();
+      const Count count = encoder::extend(
+              fwd ? encoder::get_fwd_compare() : encoder::get_rev_compare());
+      encoder::clear_cc_interrupt();
+      if (fwd) {
+        encoder::trigger_clear();
+      }
+      if ((Axes::begin_event(count, fwd) | ...)) {
+        (Axes::step_gen::set_triggered(Axes::needs_trigger()), ...);
+        encoder::trigger_manual_pulse();
+      }
+      (Axes::end_event(count), ...);
+      encoder::trigger_restore();
+      update_channels(count);
+    }
+
+  private:
+    static bool primary_direction() {
+      bool found = false, dir = false;
+      ((!found && Axes::enabled ? (found = true, dir = Axes::step_gen::get_direction()) : false), ...);
+      return dir;
+    }
+
+    // Nearest jump on a side, or the waypoint if it is further (or none)
+    static Count nearest(bool reverse_side, Count count) {
+      Count best = reverse_side ? (count - reach) : (count + reach);
+      uint32_t best_distance = reach;
+      auto consider = [&](Count at) {
+        uint32_t distance = reverse_side ? (count - at) : (at - count);
+        if (distance < best_distance) {
+          best_distance = distance;
+          best = at;
+        }
+      };
+      ((Axes::enabled ? consider(Axes::jump_on(reverse_side)) : void()), ...);
+      return best;
+    }
+  };
+
+  using leadscrew = Axis<gear::Engine<0>, devices::step_gen>;
+  using cross_slide = Axis<gear::Engine<1>, devices::step_gen2>;
+
+  using all = Group<leadscrew, cross_slide>;
+
+}
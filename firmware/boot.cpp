@@ -11,16 +11,17 @@ void SystemInit() {
   apply(set(RccCr::hseon));
   for (auto hse_ready = read(RccCr::hserdy); !apply(hse_ready); );
   apply(
-    write(RccCfgr::hpre, 0), // div1
-    write(RccCfgr::ppre2, 0), // apb2 : div1
-    write(RccCfgr::ppre1, 4), // apb1 : div2
+    write(RccCfgr::hpre, mcu::clocks.hpre_code()), // see mcu::ClockTree
+    write(RccCfgr::ppre2, mcu::clocks.ppre2_code()),
+    write(RccCfgr::ppre1, mcu::clocks.ppre1_code()),
+    write(RccCfgr::adcpre, mcu::clocks.adcpre_code()),
     set(RccCfgr::pllsrc), // source HSE
-    write(RccCfgr::pllmul, 0x7) //pllmul:9
+    write(RccCfgr::pllmul, mcu::clocks.pllmul_code())
   );
   apply(set(RccCr::pllon)); // enable pll
   for(auto pllrdy = read(RccCr::pllrdy); !apply(pllrdy); );
   
-  apply(write(FlashAcr::latency, 2u)); // Flash wait state 2
+  apply(write(FlashAcr::latency, mcu::clocks.flash_latency())); // wait states
   
   apply(write(RccCfgr::sw, RccCfgr::sw_val::pll)); // Clock switch : source PLL
   for (auto swrdy = read(RccCfgr::sws); apply(swrdy) != RccCfgr::sw_val::pll; );
@@ -37,13 +38,16 @@ void SystemInit() {
     set(RccApb1enr::tim2en),
     set(RccApb2enr::tim1en),
     set(RccApb2enr::usart1en),
+    set(RccApb2enr::adc1en),
     set(RccApb1enr::usart2en),
+    set(RccApb1enr::pwren),
+    set(RccApb1enr::bkpen),
     set(RccAhbenr::dma1en)
   );
   
   // Systick timer
   apply(
-    write(Stk_Load::Reload, 9000 - 1), // 1ms timer
+    write(Stk_Load::Reload, mcu::systick_reload - 1), // 1ms timer
     clear(Stk_Ctrl::Clksource),
     set(Stk_Ctrl::TickInt),
     set(Stk_Ctrl::Enable),
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <numeric>
+
+// Electronic cam: the output position is a piecewise linear function of the
+// input (spindle) position, repeating every `period` counts. Every segment
+// has an exact slope n / D (common D). With the line L(c) (sum of the slopes
+// from the start of the period) the output is the one the gear engine makes:
+//   output(c) = floor((2 * L(c) + D) / (2 * D))
+// Output has to advance a whole number of steps per period, so the error is
+// periodic and the first step after (and the last one before) each segment
+// start can be computed in advance. Crossing any number of segments (dwells
+// included) is then a table lookup in the ISR.
+//
+// Slopes are not negative: the output never moves against the input, which
+// is what keeps the output direction of the gear tied to the spindle's. A
+// retract is a separate (timed) move, not a cam segment.
+namespace cam {
+
+  struct Transition {
+    uint16_t delta;        // counts between the segment start and the step
+    uint16_t origin_delta; // counts between the segment start and the start of
+                           // the segment the step is in
+    int error;             // error after the step
+    uint8_t segment;       // segment the step is in
+  };
+
+  struct Segment {
+    uint16_t start;  // offset within the period
+    uint16_t length; // slope applies from start to start + length
+    int n;           // slope: n / D, 0 <= n < D
+    Transition forward; // first step after the start (input moving forward)
+    Transition reverse; // last step before the start (input moving back)
+  };
+
+  template <typename Rational>
+  struct Piece {
+    uint16_t length; // encoder counts
+    Rational slope;  // output steps per encoder count
+  };
+
+  struct Table {
+    static constexpr uint8_t capacity = 16;
+    std::array<Segment, capacity> segments{};
+    uint8_t size = 0; // no cam if zero
+    int d = 1;
+    uint16_t period = 0;
+    int32_t steps = 0; // output steps per period
+
+    uint8_t next(uint8_t i) const { return (i + 1 == size) ? 0 : i + 1; }
+    uint8_t prev(uint8_t i) const { return (i == 0) ? size - 1 : i - 1; }
+
+    // Returns false (and leaves an empty table) if the pieces are not usable:
+    // slope of one or more steps per count (or a negative one), period over
+    // half of the counter range or a fractional number of output steps per
+    // period.
+    template <typename Rational>
+    bool build(const Piece<Rational>* pieces, uint8_t count) {
+      size = 0;
+      if (count == 0 || count > capacity) {
+        return false;
+      }
+      int64_t common = 1;
+      for (uint8_t i = 0; i < count; ++i) {
+        common = std::lcm(common, int64_t(pieces[i].slope.denominator()));
+        if (common > 0x7FFF) {
+          return false;
+        }
+      }
+      int64_t total = 0;
+      uint32_t start = 0;
+      for (uint8_t i = 0; i < count; ++i) {
+        const auto& p = pieces[i];
+        int64_t n = int64_t(p.slope.numerator()) * (common / p.slope.denominator());
+        if (p.length == 0 || n >= common) {
+          return false;
+        }
+        segments[i] = {static_cast<uint16_t>(start), p.length, static_cast<int>(n)};
+        start += p.length;
+        total += n * p.length;
+      }
+      if (start > 0x7FFF || total == 0 || (total % common) != 0) {
+        return false;
+      }
+      d = static_cast<int>(common);
+      period = start;
+      steps = total / common;
+      size = count;
+      std::array<int64_t, capacity> line{};
+      for (uint8_t i = 1; i < size; ++i) {
+        line[i] = line[i - 1] + int64_t(segments[i - 1].n) * segments[i - 1].length;
+      }
+      for (uint8_t j = 0; j < size; ++j) {
+        segments[j].forward = find_forward(line, j);
+        segments[j].reverse = find_reverse(line, j);
+      }
+      return true;
+    }
+
+  private:
+    static constexpr int64_t floor_div(int64_t a, int64_t b) { // b > 0
+      return (a >= 0) ? a / b : -((-a + b - 1) / b);
+    }
+
+    int64_t output(int64_t l) const {
+      return floor_div(2 * l + d, 2 * int64_t(d));
+    }
+
+    // Smallest c > start with output(c) > output(start), walking forward
+    // through the segments (and into the next period)
+    Transition find_forward(const std::array<int64_t, capacity>& line, uint8_t j) const {
+      const int64_t o = output(line[j]);
+      const int64_t target = int64_t(d) * (2 * o + 1); // 2 * L(c) >= target
+      int64_t at = 0, l = line[j];
+      for (uint8_t t = j, i = 0; i <= size; t = next(t), ++i) {
+        const auto& s = segments[t];
+        if (s.n > 0) {
+          int64_t c = std::max<int64_t>(1, -floor_div(2 * l - target, 2 * int64_t(s.n)));
+          if (c <= s.length) {
+            int error = static_cast<int>(l + s.n * c - int64_t(d) * (o + 1));
+            if (c == s.length) { // step at the end, state is in the next one
+              return {static_cast<uint16_t>(at + c), static_cast<uint16_t>(at + c), error, next(t)};
+            }
+            return {static_cast<uint16_t>(at + c), static_cast<uint16_t>(at), error, t};
+          }
+        }
+        at += s.length;
+        l += int64_t(s.n) * s.length;
+      }
+      return {}; // not reached, steps > 0
+    }
+
+    // Largest c < start with output(c) < output(start), walking back
+    Transition find_reverse(const std::array<int64_t, capacity>& line, uint8_t j) const {
+      const int64_t o = output(line[j]);
+      const int64_t target = int64_t(d) * (2 * o - 1); // 2 * L(c) < target
+      int64_t at = 0, l = line[j];
+      for (uint8_t t = prev(j), i = 0; i <= size; t = prev(t), ++i) {
+        const auto& s = segments[t];
+        at += s.length;
+        l -= int64_t(s.n) * s.length; // L at the start of segment t
+        int64_t c = s.length - 1;
+        if (s.n > 0) {
+          c = std::min(c, floor_div(target - 2 * l - 1, 2 * int64_t(s.n)));
+        }
+        else if (2 * l >= target) {
+          c = -1;
+        }
+        if (c >= 0) {
+          int error = static_cast<int>(l + s.n * c - int64_t(d) * (o - 1));
+          return {static_cast<uint16_t>(at - c), static_cast<uint16_t>(at), error, t};
+        }
+      }
+      return {}; // not reached, steps > 0
+    }
+  };
+
+}
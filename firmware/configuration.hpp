@@ -1,40 +1,232 @@
 #pragma once
 
 #include <optional>
+#include <array>
 #include "threads.hpp"
 #include "thread_list.hpp"
+#include "cam.hpp"
+#include "gear.hpp"
 
 struct Configuration {
   using gearing_ratio_t = std::pair<uint16_t, uint16_t>;
   
   uint16_t encoder_resolution{2400u};
   gearing_ratio_t encoder_gearing{1, 1};
+  bool use_index{false}; // index (Z) channel wired, encoder mounted 1:1 on the spindle
+  // Input is step (A) / direction (B) from a motion controller instead of an
+  // encoder. Resolution is then input steps per "revolution", index is unused.
+  // STEP goes to PA8 and PA1 (period measurement), DIR to PA9.
+  bool step_dir_input{false};
+  bool invert_input_dir_pin{false};
   
   uint16_t stepper_full_steps{200u};
   uint16_t stepper_micro_steps{8};
   gearing_ratio_t stepper_gearing{1, 1};
+  // Microstep switching: above `coarse_above` (microsteps/s) the driver is
+  // set to `coarse_micro_steps`, back below `fine_below`. Pin codes are the
+  // MS1/MS2 levels of the two settings.
+  bool switch_micro_steps{false};
+  uint16_t coarse_micro_steps{2};
+  uint8_t micro_steps_code{0b11}, coarse_micro_steps_code{0b01};
+  uint32_t coarse_above{40000}, fine_below{30000};
+  // Leadscrew backlash (microsteps), taken up by a burst at `backlash_rate`
+  // (steps/s) on every reversal of the gear. Not with microstep switching.
+  uint16_t backlash_steps{0};
+  uint32_t backlash_rate{50000};
+  // Encoder on the leadscrew motor (see devices::motor_encoder), counts per
+  // motor revolution. Following errors (microsteps) beyond the deadband are
+  // made up by the gear, beyond the limit the cycle is stopped. A loaded
+  // stepper lags up to 2 full steps without losing one, the deadband is never
+  // below that (see correction_deadband()).
+  bool motor_encoder{false};
+  bool invert_motor_encoder{false};
+  uint16_t motor_encoder_counts{400};
+  uint16_t following_deadband{24};
+  uint16_t following_limit{200};
+  // Encoder counts a reversal of the gear is held back (see axes::Axis), stops
+  // the motor chattering when the spindle rests on a step boundary
+  uint8_t reversal_hysteresis{0};
+  // Handwheel jogging (see devices::handwheel): leadscrew steps per detent
+  // are selected from the multipliers, moves are ramped at `jog_rate`
+  bool handwheel{false};
+  bool invert_handwheel{false};
+  uint8_t handwheel_counts{4}; // per detent
+  std::array<uint16_t, 3> jog_multipliers{1, 10, 100};
+  uint32_t jog_rate{8000};
+  // Feed work (turning, not threading): the selected pitch is the feed per
+  // revolution and the override potentiometer (see devices::feed_override)
+  // scales it by override_min / 32 to override_max / 32. Threads keep the
+  // exact ratio.
+  bool feed{false};
+  bool feed_override{false};
+  uint8_t override_min{16}, override_max{48};
+  // E-STOP contact (normally closed to ground) on PA0, see devices::estop.
+  // Only if wired: the input is pulled up, an open one reads as tripped.
+  bool estop{false};
   
   unsigned step_pulse_ns{1200};
   unsigned step_dir_hold_ns{400};
   bool invert_step_pin{false};
   bool invert_dir_pin{true};
+
+  // Cross slide (second axis), used for tapers
+  uint16_t cross_full_steps{200u};
+  uint16_t cross_micro_steps{8};
+  gearing_ratio_t cross_gearing{1, 1};
+  bool invert_cross_dir_pin{false}; // forward is towards the spindle axis
+
+  uint32_t max_step_rate{16000}; // steps/s, for moves not geared to the spindle
+  uint32_t acceleration{32000};  // steps/s^2
+  
+  uint8_t cycle_passes{4};       // threading cycle, each start is cut once per pass
   
   using Rational = threads::Rational;
   
   Rational leadscrew_pitch{threads::tpi_pitch(15)};
+  // Measured pitch error: correction steps per `pitch_segment` output steps
+  // from `pitch_origin` (the output position at power on is 0), see pitch.hpp
+  int32_t pitch_origin{0};
+  uint32_t pitch_segment{2400};
+  std::array<int8_t, 16> pitch_corrections{};
+  Rational cross_screw_pitch{1}; // mm
+  
+  // Taper as diameter change over length (e.g. 1/16 for NPT), no taper if
+  // zero. Given as a ratio so it is exact, the angle would not be rational.
+  Rational taper{0};
+  bool taper_outward{false}; // diameter grows in the carriage's forward direction
+
+  // Leadscrew steps from an oscillator locked to the spindle (see nco.hpp)
+  // instead of the encoder compares. For steps many counts apart (D / N of
+  // 60 and more), closer to the gear's ratios the gear times them better.
+  // sim/nco.cpp compares the two.
+  bool nco_output{false};
+
+  // Rotary table on the leadscrew output (hobbing and indexing). Ratios are
+  // set up with 64 bit rationals: teeth, worm and microsteps multiply up.
+  // Hobbing needs fewer table steps per hob revolution than encoder counts
+  // (see verify_ratio): starts x worm x steps per motor turn / divisions
+  // below the encoder resolution. With 1600 steps, a 90:1 worm and 2400
+  // counts that is more than 60 teeth per start, fewer teeth need fewer
+  // microsteps or a finer encoder. Selected on the display, which refuses
+  // a ratio out of range (see toggle_rotary() in main.cpp).
+  using WideRational = boost::rational<uint64_t>;
+  bool rotary{false};
+  gearing_ratio_t rotary_worm{90, 1}; // motor turns : table turns
+  uint16_t rotary_divisions{72};      // teeth of the gear being cut
+  uint8_t hob_starts{1};
+  uint32_t rotary_division = 0;       // indexing: divisions moved (all turns)
+
+  // Cam mode (leadscrew follows a piecewise pitch instead of the thread),
+  // available if there are pieces. See cam_piece().
+  using CamPiece = cam::Piece<Rational>;
+  std::array<CamPiece, cam::Table::capacity> cam_pieces{};
+  uint8_t cam_size{0};
 
   threads::thread thread = threads::pitch_list[threads::default_pitch_index];
   int16_t pitch_list_index = threads::default_pitch_index;
+  uint8_t start_index = 0; // selected start of a multi-start thread
+  Rational cycle_length{20}; // mm of carriage travel per threading pass
+  // Between passes the cross slide withdraws the tool by `cycle_retract`
+  // before the carriage returns, and feeds it back in after, `cycle_infeed`
+  // deeper for every new pass (mm on the radius). Without a retract the
+  // cross slide is worked by hand: the cycle waits for the cycle button
+  // after the pass (tool out) and after the return (tool in for the next).
+  Rational cycle_retract{0};
+  Rational cycle_infeed{0};
   
   Configuration() {
     rationals.encoder = {encoder_resolution * encoder_gearing.first, encoder_gearing.second};
     rationals.steps_per_rev = {stepper_full_steps * stepper_micro_steps *
       stepper_gearing.first, stepper_gearing.second};
+    rationals.cross_steps_per_rev = {cross_full_steps * cross_micro_steps *
+      cross_gearing.first, cross_gearing.second};
   }
   
   Rational calculate_ratio() const {
     return calculate_ratio_for_pitch(thread.pitch.value);
   }
+
+  // Cam piece advancing the carriage at `pitch` (zero for a dwell) for a
+  // number of spindle revolutions (fraction rounded down to whole counts)
+  CamPiece cam_piece(const Rational& pitch, const Rational& revolutions) const {
+    auto counts = revolutions * rationals.encoder;
+    return {static_cast<uint16_t>(counts.numerator() / counts.denominator()),
+            calculate_ratio_for_pitch(pitch)};
+  }
+
+  // Table turns hob_starts / divisions per spindle (hob) revolution
+  WideRational calculate_hobbing_ratio() const {
+    return WideRational{hob_starts, rotary_divisions} * table_steps_per_rev() /
+            wide(rationals.encoder);
+  }
+
+  // At most one output step per count, extended compares take any k and the
+  // terms only need to fit the gear engine
+  static bool verify_ratio(const WideRational& r) {
+    return (r.numerator() > 0) && (r.numerator() < r.denominator()) &&
+            (r.denominator() <= gear::max_term);
+  }
+
+  // Output position of a division relative to division 0, rounded to the
+  // nearest step. Taken from the division number (counted over all turns),
+  // so rounding errors never add up.
+  int32_t division_position(uint32_t division) const {
+    auto steps = WideRational{division, rotary_divisions} * table_steps_per_rev();
+    return static_cast<int32_t>((steps.numerator() + steps.denominator() / 2) / steps.denominator());
+  }
+
+  // Following errors up to this are lag, not lost steps
+  int32_t correction_deadband() const {
+    return std::max<int32_t>(following_deadband, 2 * stepper_micro_steps);
+  }
+
+  // Microsteps per pulse in the coarse setting (1 if switching is not usable)
+  int coarse_step() const {
+    if (!switch_micro_steps || coarse_micro_steps == 0 ||
+        (stepper_micro_steps % coarse_micro_steps) != 0) {
+      return 1;
+    }
+    return stepper_micro_steps / coarse_micro_steps;
+  }
+
+  bool use_taper() const {
+    return (taper.numerator() != 0) && verify_taper();
+  }
+
+  // Cross slide steps per encoder count: radial feed is half of the diameter
+  // change over the carriage travel per spindle revolution (the pitch)
+  Rational calculate_cross_ratio() const {
+    return (thread.pitch.value * taper / 2u) / cross_screw_pitch *
+            rationals.cross_steps_per_rev / rationals.encoder;
+  }
+
+  // Both axes step at most once per encoder count
+  bool verify_taper() const {
+    auto r = calculate_cross_ratio();
+    return (r.numerator() < r.denominator()) && (r.denominator() <= unsigned(gear::max_term));
+  }
+
+  // Number of encoder counts after which the spindle is back at the same angle
+  // (i.e. a whole number of spindle revolutions)
+  unsigned phase_period() const {
+    return rationals.encoder.numerator();
+  }
+  
+  // Carriage travel in output steps (rounded to the nearest step)
+  int32_t length_to_steps(const Rational& length) const {
+    auto steps = length / leadscrew_pitch * rationals.steps_per_rev;
+    return static_cast<int32_t>((steps.numerator() + steps.denominator() / 2) / steps.denominator());
+  }
+  
+  // Cross slide travel in its steps (rounded to the nearest step)
+  int32_t cross_length_to_steps(const Rational& length) const {
+    auto steps = length / cross_screw_pitch * rationals.cross_steps_per_rev;
+    return static_cast<int32_t>((steps.numerator() + steps.denominator() / 2) / steps.denominator());
+  }
+
+  bool auto_retract() const {
+    return cycle_retract.numerator() != 0;
+  }
   
   void cycle_thread(bool fwd) {
     //TODO: skip incompatible threads
@@ -49,10 +241,18 @@ struct Configuration {
       pitch_list_index = i;
     }
     thread = threads::pitch_list[pitch_list_index];
+    start_index = 0;
   }
   
   void select_thread(int16_t new_pitch_index) {
     thread = threads::pitch_list[pitch_list_index = new_pitch_index];
+    start_index = 0;
+  }
+
+  void next_start() {
+    if (++start_index == thread.starts) {
+      start_index = 0;
+    }
   }
   
   enum thread_compatibility : uint8_t {
@@ -61,14 +261,18 @@ struct Configuration {
     thread_too_small
   };
   
-  template <typename TimerCounter = uint16_t>
-  thread_compatibility verify_thread(int16_t thread_index) const {
-    auto ratio = calculate_ratio_for_pitch(threads::pitch_list[thread_index].pitch.value);
+  // Steps further apart than the 16 bit counter are reached through waypoint
+  // compares (see axes.hpp), only the gear terms are limited. They are
+  // limited as scaled for the starts, f_scale is phase::gear_scale.
+  template <typename GearScale>
+  thread_compatibility verify_thread(int16_t thread_index, GearScale f_scale) const {
+    const auto& thr = threads::pitch_list[thread_index];
+    auto ratio = calculate_ratio_for_pitch(thr.pitch.value);
     auto n = ratio.numerator(), d = ratio.denominator();
     if (n >= d) {
       return thread_too_large;
     }
-    if (((d + n - 1) / n) > (std::numeric_limits<TimerCounter>::max() / 2)) {
+    if (uint64_t(d) * f_scale(thr.starts, n, phase_period()) > unsigned(gear::max_term)) {
       return thread_too_small;
     }
     return thread_OK;
@@ -78,10 +282,19 @@ private:
   struct Bundle {
     Rational encoder{};
     Rational steps_per_rev{};
+    Rational cross_steps_per_rev{};
   };
   
   Bundle rationals{};
 
+  static WideRational wide(const Rational& r) {
+    return {r.numerator(), r.denominator()};
+  }
+
+  WideRational table_steps_per_rev() const {
+    return wide(rationals.steps_per_rev) * WideRational{rotary_worm.first, rotary_worm.second};
+  }
+
   Rational calculate_ratio_for_pitch(const Rational& pitch) const {
     return (pitch / leadscrew_pitch) * rationals.steps_per_rev / rationals.encoder;
   }
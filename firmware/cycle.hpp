@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+
+#include "devices.hpp"
+
+// Threading cycle: engage in phase, cut to the stop position, disengage,
+// withdraw the tool, return to the start of the pass, feed the tool in and
+// engage again for the next start/pass.
+// Sequencing is done in the main loop on top of control::State; only the stop
+// is handled in the step interrupt so the last step is exact at any speed.
+namespace cycle {
+
+  namespace detail {
+    inline volatile int32_t stop_position = 0;
+    inline volatile bool stop_armed = false;
+    inline volatile bool stop_reached = false;
+  }
+
+  // Output position where the gear is disengaged (forward passes only)
+  inline void arm_stop(int32_t position) {
+    detail::stop_reached = false;
+    detail::stop_position = position;
+    detail::stop_armed = true;
+  }
+
+  inline void disarm_stop() {
+    detail::stop_armed = false;
+    detail::stop_reached = false;
+  }
+
+  // Called from the step interrupt after the output position is updated. Next
+  // geared step is at least one encoder count later, so clearing the trigger
+  // here is in time. CC interrupt is disabled first so the gear ISR can not
+  // restore the trigger afterwards. In NCO mode the run is ended instead.
+  // `step` is the signed output steps made: several with microstep switching
+  // or at the end of a backlash burst.
+  inline void on_step(int32_t position, int step = 1) {
+    if (detail::stop_armed && (position >= detail::stop_position) &&
+        (position - step < detail::stop_position)) {
+      using devices::encoder;
+      encoder::disable_cc_interrupt();
+      encoder::trigger_clear();
+      devices::step_gen::stop_run();
+      detail::stop_armed = false;
+      detail::stop_reached = true;
+    }
+  }
+
+  // True once after the stop position is reached
+  inline bool take_stop() {
+    if (detail::stop_reached) {
+      detail::stop_reached = false;
+      return true;
+    }
+    return false;
+  }
+
+  // Pass bookkeeping, starts of a multi-start thread are cut one after the
+  // other on each pass
+  class Counter {
+  public:
+    void start(uint8_t passes, uint8_t starts) {
+      passes_ = passes;
+      starts_ = starts;
+      pass_ = 0;
+      start_ = 0;
+      active_ = (passes > 0);
+    }
+
+    void stop() {
+      active_ = false;
+    }
+
+    // Returns true if the selected start has to move to the next one
+    bool advance() {
+      if (++start_ < starts_) {
+        return true;
+      }
+      start_ = 0;
+      if (++pass_ == passes_) {
+        active_ = false;
+      }
+      return (starts_ > 1);
+    }
+
+    bool active() const { return active_; }
+    uint8_t pass() const { return pass_; }
+    uint8_t passes() const { return passes_; }
+    uint8_t start_no() const { return start_; }
+    uint8_t starts() const { return starts_; }
+
+  private:
+    uint8_t passes_{0};
+    uint8_t starts_{1};
+    uint8_t pass_{0};
+    uint8_t start_{0};
+    bool active_{false};
+  };
+
+}
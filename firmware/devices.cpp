@@ -1,6 +1 @@
 #include "devices.hpp"
-
-namespace devices {
-  step_gen::State step_gen::state = {};
-}
-
@@ -2,19 +2,81 @@
 
 #include <string_view>
 #include <array>
+#include <utility>
+#include <type_traits>
 
 #include "mcu.hpp"
+#include "ramp.hpp"
 
 namespace devices {
 
-  struct step_gen {
+  // Step generator timers: channel 3 is the step output (channel 4 is on the
+  // direction pin), ITR0 (TIM1 TRGO) the trigger. TIM3 and TIM4 are the same
+  // in this respect.
+  struct tim3_step_timer {
+    static constexpr Kvasir::nvic::irq_number_t irq = Kvasir::IRQ::tim3_irqn;
+    static constexpr auto opm = Kvasir::Tim3Cr1::opm;
+    static constexpr auto urs = Kvasir::Tim3Cr1::urs;
+    static constexpr auto arpe = Kvasir::Tim3Cr1::arpe;
+    static constexpr auto cen = Kvasir::Tim3Cr1::cen;
+    static constexpr auto psc = Kvasir::Tim3Psc::psc;
+    static constexpr auto arr = Kvasir::Tim3Arr::arr;
+    static constexpr auto oc3m = Kvasir::Tim3Ccmr2Output::oc3m;
+    static constexpr auto oc3fe = Kvasir::Tim3Ccmr2Output::oc3fe;
+    static constexpr auto oc3pe = Kvasir::Tim3Ccmr2Output::oc3pe;
+    static constexpr auto ccr3 = Kvasir::Tim3Ccr3::ccr3;
+    static constexpr auto cc3e = Kvasir::Tim3Ccer::cc3e;
+    static constexpr auto cc3p = Kvasir::Tim3Ccer::cc3p;
+    static constexpr auto oc4m = Kvasir::Tim3Ccmr2Output::oc4m; // channel 4: quadrature B
+    static constexpr auto oc4pe = Kvasir::Tim3Ccmr2Output::oc4pe;
+    static constexpr auto ccr4 = Kvasir::Tim3Ccr4::ccr4;
+    static constexpr auto cc4e = Kvasir::Tim3Ccer::cc4e;
+    static constexpr auto cc4p = Kvasir::Tim3Ccer::cc4p;
+    static constexpr auto sms = Kvasir::Tim3Smcr::sms;
+    static constexpr auto ts = Kvasir::Tim3Smcr::ts;
+    static constexpr auto uie = Kvasir::Tim3Dier::uie;
+    static constexpr auto uif = Kvasir::Tim3Sr::uif;
+    static constexpr auto ug = Kvasir::Tim3Egr::ug;
+  };
+
+  struct tim4_step_timer {
+    static constexpr Kvasir::nvic::irq_number_t irq = Kvasir::IRQ::tim4_irqn;
+    static constexpr auto opm = Kvasir::Tim4Cr1::opm;
+    static constexpr auto urs = Kvasir::Tim4Cr1::urs;
+    static constexpr auto arpe = Kvasir::Tim4Cr1::arpe;
+    static constexpr auto cen = Kvasir::Tim4Cr1::cen;
+    static constexpr auto psc = Kvasir::Tim4Psc::psc;
+    static constexpr auto arr = Kvasir::Tim4Arr::arr;
+    static constexpr auto oc3m = Kvasir::Tim4Ccmr2Output::oc3m;
+    static constexpr auto oc3fe = Kvasir::Tim4Ccmr2Output::oc3fe;
+    static constexpr auto oc3pe = Kvasir::Tim4Ccmr2Output::oc3pe;
+    static constexpr auto ccr3 = Kvasir::Tim4Ccr3::ccr3;
+    static constexpr auto cc3e = Kvasir::Tim4Ccer::cc3e;
+    static constexpr auto cc3p = Kvasir::Tim4Ccer::cc3p;
+    static constexpr auto oc4m = Kvasir::Tim4Ccmr2Output::oc4m; // channel 4: quadrature B
+    static constexpr auto oc4pe = Kvasir::Tim4Ccmr2Output::oc4pe;
+    static constexpr auto ccr4 = Kvasir::Tim4Ccr4::ccr4;
+    static constexpr auto cc4e = Kvasir::Tim4Ccer::cc4e;
+    static constexpr auto cc4p = Kvasir::Tim4Ccer::cc4p;
+    static constexpr auto sms = Kvasir::Tim4Smcr::sms;
+    static constexpr auto ts = Kvasir::Tim4Smcr::ts;
+    static constexpr auto uie = Kvasir::Tim4Dier::uie;
+    static constexpr auto uif = Kvasir::Tim4Sr::uif;
+    static constexpr auto ug = Kvasir::Tim4Egr::ug;
+  };
+
+  template <typename Timer, typename StepPin, typename DirPin>
+  struct step_generator {
     static constexpr uint64_t ClockFreq = mcu::CPU_Clock_Freq_Hz;
     static constexpr uint8_t ClockDiv = 2;
+    static constexpr uint16_t TimedClockDiv = ClockFreq / 1'000'000; // timed moves: 1us resolution, 65ms max. period
+    static_assert(ClockFreq % 1'000'000 == 0, "timed moves count whole microseconds");
 
     static constexpr unsigned int min_count = mcu::min_timer_capture_count; // required by timer
+    static constexpr unsigned int max_delay = std::numeric_limits<uint16_t>::max() * ClockDiv; // see set_delay
 
-    using step_pin = mcu::pins::step_pin;
-    using dir_pin = mcu::pins::dir_pin;
+    using step_pin = StepPin;
+    using dir_pin = DirPin;
 
     struct start_stop {
       volatile uint16_t cnt_start{}, cnt_stop{};
@@ -26,9 +88,28 @@ namespace devices {
       volatile bool delayed_pulse = false;
       volatile bool direction = false; // true -> reverse direction
       volatile bool direction_polarity = false; // not inverted
+      volatile uint16_t counts_step_timed = 0; // step pulse duration for timed moves
+      volatile bool timed = false; // timed move in progress, not driven by the encoder
+      volatile uint32_t pulses_left = 0;
+      ramp::Generator ramp{};
+      volatile bool running = false;  // free running, paced by the caller (NCO)
+      volatile bool stopping = false;
+      volatile bool pulse_active = false, pulse_next = false;
+      volatile bool inhibited = false; // E-STOP, see inhibit()
+      // Backlash compensation, see compensate()
+      volatile uint16_t backlash = 0;     // extra pulses per reversal
+      volatile uint16_t counts_burst = 0; // pulse period of the burst
+      volatile bool compensating = false;
+      volatile bool pin_direction = false;
+      volatile int8_t in_flight = 0;      // signed pulse running in the burst
+      volatile uint16_t slack_left = 0;   // first pulses of a timed move taking up the slack
+      // Signed pulses and gear steps, the gear (CC interrupt) queues, the
+      // step interrupt emits and reports: one writer each
+      volatile int32_t queued = 0, emitted = 0;
+      volatile int32_t steps_queued = 0, steps_reported = 0;
     };
 
-    static State state;
+    inline static State state{};
 
     static void init() {
       using namespace Kvasir;
@@ -38,21 +119,22 @@ namespace devices {
             write(dir_pin::cr::mode, gpio::PinMode::Output_2Mhz),
             write(dir_pin::cr::cnf, gpio::PinConfig::Output_push_pull));
       //Timer
-      apply(set(Tim3Cr1::opm),
-            write(Tim3Psc::psc, ClockDiv - 1),
-            write(Tim3Ccmr2Output::oc3m, 0b111), //PWM mode 2
-            write(Tim3Smcr::sms, 0b110), // Trigger mode
-            write(Tim3Smcr::ts, 0), // ITR0 - tim1
-            set(Tim3Ccer::cc3e),
-            clear(Tim3Sr::uif),
-            set(Tim3Dier::uie)  // enable update interrupt
+      apply(set(Timer::opm),
+            set(Timer::urs), // only counter overflow generates an update interrupt
+            write(Timer::psc, ClockDiv - 1),
+            write(Timer::oc3m, 0b111), //PWM mode 2
+            write(Timer::sms, 0b110), // Trigger mode
+            write(Timer::ts, 0), // ITR0 - tim1
+            set(Timer::cc3e),
+            clear(Timer::uif),
+            set(Timer::uie)  // enable update interrupt
       );
-      mcu::enable_interrupt<IRQ::tim3_irqn>();
+      mcu::enable_interrupt<Timer::irq>();
     }
     
     static void configure(unsigned int dir_setup_ns, unsigned int step_pulse_ns,
                           bool invert_step, bool invert_dir) {
-      apply(write(Kvasir::Tim3Ccer::cc3p, invert_step));
+      apply(write(Timer::cc3p, invert_step));
       state.direction_polarity = invert_dir;
       apply(write(dir_pin::odr, state.direction ^ state.direction_polarity));
 
@@ -65,9 +147,19 @@ namespace devices {
       state.counts_reverse = {cnt_setup_delay, 
                               static_cast<uint16_t>(cnt_setup_delay + cnt_step)};
       state.counts_step = cnt_step;
+      state.counts_step_timed = 1u + static_cast<unsigned int>(
+              step_pulse_ns * (ClockFreq / TimedClockDiv) / nanosec);
       setup_next_pulse();
     }
 
+    // Backlash in pulses, emitted at `rate` pulses per second on reversals
+    static void set_backlash(uint16_t pulses, uint32_t rate) {
+      constexpr uint32_t TimerFreq = ClockFreq / ClockDiv;
+      state.counts_burst = static_cast<uint16_t>(std::clamp<uint32_t>(
+              TimerFreq / std::max<uint32_t>(rate, 1), 2 * state.counts_step + min_count, 0xFFFF));
+      state.backlash = pulses;
+    }
+
     static inline bool get_direction() {
       return state.direction;
     }
@@ -76,9 +168,9 @@ namespace devices {
       state.direction = new_dir;
       using namespace Kvasir;
       apply(write(dir_pin::odr, new_dir ^ state.direction_polarity));
-      apply(clear(Tim3Ccmr2Output::oc3fe),
-            write(Tim3Ccr3::ccr3, state.counts_reverse.cnt_start),
-            write(Tim3Arr::arr, state.counts_reverse.cnt_stop));
+      apply(clear(Timer::oc3fe),
+            write(Timer::ccr3, state.counts_reverse.cnt_start),
+            write(Timer::arr, state.counts_reverse.cnt_stop));
     }
     
     static void set_delay(unsigned delay_count) {
@@ -103,27 +195,679 @@ namespace devices {
       }
     }
 
-    static inline void process_interrupt() {
-      apply(clear(Kvasir::Tim3Sr::uif));
-      setup_next_pulse();
+    // Returns the (signed) steps made by the period that ended
+    static inline int process_interrupt() {
+      apply(clear(Timer::uif));
+      if (state.inhibited) { // the period ended before the stop, its pulse was made
+        return state.running ? (state.pulse_active ? 1 : 0) :
+               (state.compensating || (state.timed && state.slack_left != 0)) ? 0 :
+               (state.direction ? -1 : 1);
+      }
+      if (state.running) {
+        bool stepped = state.pulse_active;
+        state.pulse_active = state.pulse_next;
+        if (state.stopping) {
+          state.running = false;
+          end_move();
+        }
+        return stepped ? 1 : 0;
+      }
+      if (state.compensating) {
+        return next_burst_pulse();
+      }
+      const int s = state.direction ? -1 : 1;
+      if (state.timed) {
+        next_timed_pulse();
+        if (state.slack_left != 0) {
+          state.slack_left = state.slack_left - 1;
+          state.emitted = state.emitted + s;
+          return 0;
+        }
+      }
+      else {
+        setup_next_pulse();
+      }
+      return s;
+    }
+
+    // Counter stops by itself after a geared pulse (one pulse mode)
+    static inline bool is_idle() {
+      return state.inhibited || (!state.compensating && !apply(read(Timer::cen)));
+    }
+
+    // Backlash compensation: a gear reversal (its pulse just triggered) is
+    // followed by a burst taking up the slack. Encoder triggers are off until
+    // it is over, gear steps meanwhile are queued (queue_step()) and made by
+    // the burst too, in order: the queue is the signed distance between the
+    // motor and its target, the gear position plus the slack on the side of
+    // the gear direction. Another reversal moves the target back, so only
+    // the slack taken so far is crossed again. Gear steps are reported when
+    // the burst ends, the trigger is left off for the gear to arm again.
+    static void compensate() {
+      using namespace Kvasir;
+      if (state.backlash == 0) {
+        return;
+      }
+      const int s = state.direction ? -1 : 1;
+      state.pin_direction = state.direction;
+      state.in_flight = s;
+      state.steps_queued = state.steps_reported + s;
+      state.queued = state.emitted + s * (1 + state.backlash);
+      state.compensating = true;
+      apply(write(Timer::sms, 0));
+    }
+
+    static inline bool is_compensating() {
+      return state.compensating && !state.inhibited;
+    }
+
+    // Pulses made by the bursts beyond the gear steps (motor position less
+    // the output position, outside of a burst)
+    static inline int32_t slack_offset() {
+      return state.emitted - state.steps_reported;
+    }
+
+    // Pulses to take up the slack towards `dir`: slack_offset() is 0 with it
+    // taken up forward, -backlash in reverse
+    static inline int32_t slack_towards(bool dir) {
+      return (dir ? -int32_t(state.backlash) : 0) - slack_offset();
+    }
+
+    // Before the gear engages towards `dir` at rest (a timed move may have
+    // left the slack on the other side): a burst without gear step
+    static void take_up_slack(bool dir) {
+      using namespace Kvasir;
+      const int32_t pulses = slack_towards(dir);
+      if (pulses == 0 || state.inhibited) {
+        return;
+      }
+      state.steps_queued = state.steps_reported;
+      state.queued = state.emitted + pulses;
+      state.pin_direction = !dir; // first pulse sets the pin, with the setup time
+      state.in_flight = 0;
+      state.compensating = true;
+      apply(write(Timer::sms, 0));
+      next_burst_pulse(); // timer is idle, this arms the first pulse
+    }
+
+    // Gear step (or reversal) while compensating, called from the CC interrupt
+    static inline void queue_step(bool reversal) {
+      if (reversal) {
+        state.direction = !state.direction;
+      }
+      const int s = state.direction ? -1 : 1;
+      state.steps_queued = state.steps_queued + s;
+      state.queued = state.queued + (reversal ? s * (1 + state.backlash) : s);
+    }
+
+    static inline bool is_moving() {
+      return state.timed;
+    }
+
+    // Moves the end of the running timed move by `steps` in direction `dir`:
+    // further along it (any amount) or back, at most down to the start of
+    // the deceleration. Returns the steps taken (none if no move runs). Not
+    // for runs (NCO).
+    static uint32_t retarget_move(bool dir, uint32_t steps) {
+      uint32_t taken = 0;
+      mcu::disable_interrupt<Timer::irq>();
+      if (state.timed && !state.running) {
+        if (dir == state.direction) {
+          taken = state.ramp.extend(steps);
+          state.pulses_left = state.pulses_left + taken;
+        }
+        else {
+          taken = state.ramp.shorten(steps);
+          state.pulses_left = state.pulses_left - taken;
+        }
+      }
+      mcu::enable_interrupt<Timer::irq>();
+      return taken;
+    }
+
+    // Encoder compare events (TIM1 TRGO) start a pulse only while triggered.
+    // Left alone during timed moves and backlash bursts.
+    static inline void set_triggered(bool on) {
+      if (!state.timed && !state.compensating && !state.inhibited) {
+        apply(write(Timer::sms, on ? 0b110 : 0));
+      }
+    }
+
+    // Starts a move of `steps` steps with a ramped speed profile. Timer is
+    // free running (not triggered by the encoder) until the move is over,
+    // gear needs to be disengaged and the timer idle. A move against the
+    // slack takes it up first, in its slow start: those pulses are not steps.
+    static void start_move(bool dir, uint32_t steps, uint32_t max_speed, uint32_t acceleration) {
+      using namespace Kvasir;
+      if (steps == 0 || state.inhibited) {
+        return;
+      }
+      const int32_t slack = slack_towards(dir);
+      state.slack_left = static_cast<uint16_t>((slack < 0) ? -slack : slack);
+      steps += state.slack_left;
+      change_direction(dir);
+      state.ramp.start(steps, ClockFreq / TimedClockDiv, max_speed, acceleration);
+      state.pulses_left = steps;
+      state.timed = true;
+      apply(write(Timer::sms, 0)); // slave mode disabled
+      apply(clear(Timer::opm),
+            set(Timer::arpe), // preload: new period starts on the next update
+            clear(Timer::oc3fe),
+            set(Timer::oc3pe),
+            write(Timer::psc, TimedClockDiv - 1));
+      set_period(state.ramp.next());
+      apply(set(Timer::ug)); // load the prescaler and the first period
+      if (!state.ramp.done()) {
+        set_period(state.ramp.next());
+      }
+      apply(set(Timer::cen));
+    }
+
+    // Free running (forward only) at the timed move clock, every period is
+    // set from the update interrupt for the one after the running period (see
+    // nco.hpp). Gear needs to be disengaged and the timer idle.
+    static void start_run(uint16_t first_period) {
+      using namespace Kvasir;
+      if (state.inhibited) {
+        return;
+      }
+      change_direction(false);
+      state.pulse_active = false;
+      state.stopping = false;
+      state.running = true;
+      state.timed = true;
+      apply(write(Timer::sms, 0)); // slave mode disabled
+      apply(clear(Timer::opm),
+            set(Timer::arpe),
+            clear(Timer::oc3fe),
+            set(Timer::oc3pe),
+            write(Timer::psc, TimedClockDiv - 1));
+      set_run_period(first_period, false);
+      apply(set(Timer::ug));
+      apply(set(Timer::cen));
+    }
+
+    // A period without pulse has the compare past its end
+    static void set_run_period(uint16_t period, bool pulse) {
+      using namespace Kvasir;
+      period = std::max<uint16_t>(period, state.counts_step_timed + min_count);
+      state.pulse_next = pulse;
+      apply(write(Timer::arr, period - 1),
+            write(Timer::ccr3, pulse ? (period - state.counts_step_timed) : 0xFFFF));
+    }
+
+    // Ends the run at the end of the running period (its pulse is dropped),
+    // back to the encoder trigger
+    static void stop_run() {
+      using namespace Kvasir;
+      apply(clear(Timer::uie)); // not ended by the interrupt in between
+      if (state.running) {
+        state.stopping = true;
+        state.pulse_active = false;
+        apply(clear(Timer::oc3pe));
+        apply(write(Timer::ccr3, 0xFFFF));
+      }
+      apply(set(Timer::uie));
+    }
+
+    static inline bool is_running() {
+      return state.running;
+    }
+
+    // E-STOP, from the highest priority interrupt: the step output is forced
+    // inactive and the timer stopped at once, the encoder trigger and new
+    // moves are off until recover(). A pulse cut short is not counted (the
+    // driver may or may not have taken it).
+    static inline void inhibit() {
+      using namespace Kvasir;
+      state.inhibited = true;
+      apply(write(Timer::oc3m, 0b100)); // forced inactive
+      apply(clear(Timer::cen));
+      apply(write(Timer::sms, 0));
+    }
+
+    // Back to the encoder trigger (gear disengaged), the move, run or burst
+    // cut by the E-STOP is dropped
+    static void recover() {
+      using namespace Kvasir;
+      apply(clear(Timer::uie));
+      state.timed = false;
+      state.running = false;
+      state.stopping = false;
+      state.pulse_active = false;
+      state.compensating = false;
+      state.in_flight = 0;
+      state.slack_left = 0;
+      state.queued = state.emitted;
+      state.steps_queued = state.steps_reported;
+      apply(clear(Timer::arpe),
+            clear(Timer::oc3pe),
+            set(Timer::opm),
+            write(Timer::psc, ClockDiv - 1),
+            write(Timer::oc3m, 0b111)); // PWM mode 2
+      apply(set(Timer::ug));
+      change_direction(state.direction); // pin left by a burst, setup time
+      state.inhibited = false;
+      apply(set(Timer::uie));
     }
 
   private:
+    // PWM mode 2: pulse is at the end of the period
+    static void set_period(uint16_t period) {
+      using namespace Kvasir;
+      period = std::max<uint16_t>(period, state.counts_step_timed + min_count);
+      apply(write(Timer::arr, period - 1),
+            write(Timer::ccr3, period - state.counts_step_timed));
+    }
+
+    static void next_timed_pulse() {
+      if (--state.pulses_left == 0) {
+        end_move();
+      }
+      else if (!state.ramp.done()) {
+        set_period(state.ramp.next());
+      }
+    }
+
+    // Ending the burst is not interrupted by the gear, no step is queued
+    // after the last check
+    static int next_burst_pulse() {
+      using namespace Kvasir;
+      if (apply(read(Timer::cen))) { // end of the pulse before the reversal
+        return -state.in_flight;
+      }
+      state.emitted = state.emitted + state.in_flight;
+      state.in_flight = 0;
+      if (state.queued == state.emitted) {
+        mcu::disable_interrupt<IRQ::tim1_cc_irqn>();
+        if (state.queued == state.emitted) {
+          state.compensating = false;
+        }
+        mcu::enable_interrupt<IRQ::tim1_cc_irqn>();
+        if (!state.compensating) {
+          const int32_t steps = state.steps_queued - state.steps_reported;
+          state.steps_reported = state.steps_queued;
+          if (state.pin_direction != state.direction) {
+            change_direction(state.direction);
+          }
+          else {
+            setup_next_pulse();
+          }
+          return steps;
+        }
+      }
+      const bool dir = (state.queued - state.emitted) < 0;
+      uint16_t period = state.counts_burst;
+      if (dir != state.pin_direction) {
+        state.pin_direction = dir;
+        apply(write(dir_pin::odr, dir ^ state.direction_polarity));
+        period = std::max<uint16_t>(period, uint16_t(state.counts_reverse.cnt_stop));
+      }
+      state.in_flight = dir ? -1 : 1;
+      apply(clear(Timer::oc3fe),
+            write(Timer::ccr3, period - state.counts_step),
+            write(Timer::arr, period));
+      apply(set(Timer::cen));
+      return 0;
+    }
+
+    // Back to pulses triggered by the encoder timer
+    static void end_move() {
+      using namespace Kvasir;
+      apply(clear(Timer::cen));
+      apply(clear(Timer::arpe),
+            clear(Timer::oc3pe),
+            set(Timer::opm),
+            write(Timer::psc, ClockDiv - 1));
+      apply(set(Timer::ug));
+      apply(write(Timer::sms, 0b110)); // Trigger mode
+      state.timed = false;
+      setup_next_pulse();
+    }
+
     static void setup_next_pulse() {
       using namespace Kvasir;
       if (state.delayed_pulse) {
-        apply(clear(Tim3Ccmr2Output::oc3fe),
-              write(Tim3Ccr3::ccr3, state.counts_delayed.cnt_start),
-              write(Tim3Arr::arr, state.counts_delayed.cnt_stop));
+        apply(clear(Timer::oc3fe),
+              write(Timer::ccr3, state.counts_delayed.cnt_start),
+              write(Timer::arr, state.counts_delayed.cnt_stop));
       }
       else {
-        apply(set(Tim3Ccmr2Output::oc3fe), // enable fast enable 
-              write(Tim3Ccr3::ccr3, 1), // For some reason 0 does not work
-              write(Tim3Arr::arr, state.counts_step));
+        apply(set(Timer::oc3fe), // enable fast enable 
+              write(Timer::ccr3, 1), // For some reason 0 does not work
+              write(Timer::arr, state.counts_step));
+      }
+    }
+  };
+
+  // Quadrature (A/B) output on channels 3 and 4 of a step timer, the pins of
+  // step and direction. Every step is one edge: the channel to toggle follows
+  // from the phase (output position modulo 4) and the direction, the other
+  // channel is frozen. Same trigger, phase delay and timed moves as
+  // step_generator, direction changes need no setup time.
+  //
+  // Edges are made one at a time, the next one is armed in the update
+  // interrupt. The timer is busy for the phase delay, step_pulse_ns and the
+  // update interrupt latency per edge. The phase delay goes up to half of the
+  // time between edges, so the edge rate is at most about 1 / (2 *
+  // (step_pulse_ns + latency)): 330 kHz (83 kHz A/B cycle) with 1200 ns, as
+  // measured by sim/quadrature.cpp. Never above the encoder count rate as
+  // long as the gear ratio is below one. step_pulse_ns is the minimum edge
+  // separation of the receiver.
+  template <typename Timer, typename PinA, typename PinB>
+  struct quadrature_generator {
+    static constexpr uint64_t ClockFreq = mcu::CPU_Clock_Freq_Hz;
+    static constexpr uint8_t ClockDiv = 2;
+    static constexpr uint16_t TimedClockDiv = ClockFreq / 1'000'000;
+
+    static constexpr unsigned int min_count = mcu::min_timer_capture_count;
+    static constexpr unsigned int max_delay = std::numeric_limits<uint16_t>::max() * ClockDiv;
+
+    using pin_A = PinA;
+    using pin_B = PinB;
+
+    struct State {
+      volatile uint16_t counts_edge = 0;  // minimum time between edges
+      volatile uint16_t counts_delay = 0; // phase delay of the next edge
+      volatile bool direction = false;    // true -> reverse direction
+      volatile bool direction_polarity = false;
+      volatile uint8_t phase = 0;         // 00, 01, 11, 10 (B, A)
+      volatile uint16_t counts_edge_timed = 0;
+      volatile bool timed = false;
+      volatile uint32_t pulses_left = 0;
+      ramp::Generator ramp{};
+      volatile bool running = false;
+      volatile bool stopping = false;
+      volatile bool pulse_active = false, pulse_next = false;
+      volatile bool inhibited = false;
+    };
+
+    inline static State state{};
+
+    static void init() {
+      using namespace Kvasir;
+      apply(write(pin_A::cr::mode, gpio::PinMode::Output_2Mhz),
+            write(pin_A::cr::cnf, gpio::PinConfig::Output_alternate_push_pull),
+            write(pin_B::cr::mode, gpio::PinMode::Output_2Mhz),
+            write(pin_B::cr::cnf, gpio::PinConfig::Output_alternate_push_pull));
+      apply(set(Timer::opm),
+            set(Timer::urs),
+            write(Timer::psc, ClockDiv - 1),
+            write(Timer::oc3m, 0b100), // both low: phase 0
+            write(Timer::oc4m, 0b100),
+            write(Timer::sms, 0b110), // Trigger mode
+            write(Timer::ts, 0), // ITR0 - tim1
+            set(Timer::cc3e),
+            set(Timer::cc4e),
+            clear(Timer::uif),
+            set(Timer::uie)
+      );
+      mcu::enable_interrupt<Timer::irq>();
+    }
+
+    // Direction setup is not needed, step pulse is the edge separation
+    static void configure(unsigned int, unsigned int step_pulse_ns,
+                          bool invert_outputs, bool invert_dir) {
+      apply(write(Timer::cc3p, invert_outputs),
+            write(Timer::cc4p, invert_outputs));
+      state.direction_polarity = invert_dir;
+
+      constexpr uint64_t TimerFreq = ClockFreq / ClockDiv;
+      constexpr uint64_t nanosec = mcu::onesec_in_ns.count();
+      state.counts_edge = std::max(min_count,
+              1u + static_cast<unsigned int>(step_pulse_ns * TimerFreq / nanosec));
+      state.counts_edge_timed = 1u + static_cast<unsigned int>(
+              step_pulse_ns * (ClockFreq / TimedClockDiv) / nanosec);
+      setup_next_pulse();
+    }
+
+    static inline bool get_direction() {
+      return state.direction;
+    }
+
+    static void change_direction(bool new_dir) {
+      state.direction = new_dir;
+      select_channel();
+    }
+
+    static void set_delay(unsigned delay_count) {
+      delay_count = delay_count / ClockDiv;
+      state.counts_delay = (delay_count >= min_count) ?
+              std::min<unsigned>(delay_count, std::numeric_limits<uint16_t>::max() - state.counts_edge) : 0;
+    }
+
+    static inline int process_interrupt() {
+      apply(clear(Timer::uif));
+      const int step = (!state.running || state.pulse_active) ? (state.direction ? -1 : 1) : 0;
+      if (step != 0) {
+        bool reverse = state.direction ^ state.direction_polarity;
+        state.phase = (state.phase + (reverse ? 3 : 1)) & 3;
+      }
+      if (state.inhibited) {
+        return step;
+      }
+      if (state.running) {
+        state.pulse_active = state.pulse_next;
+        if (state.stopping) {
+          state.running = false;
+          end_move();
+        }
+        else if (!state.pulse_active) { // channel modes are not preloaded
+          apply(write(Timer::oc3m, 0b000), write(Timer::oc4m, 0b000));
+          return step;
+        }
+      }
+      else if (state.timed) {
+        next_timed_pulse();
+      }
+      else {
+        setup_next_pulse();
+      }
+      select_channel();
+      return step;
+    }
+
+    static inline bool is_idle() {
+      return !apply(read(Timer::cen));
+    }
+
+    static inline bool is_moving() {
+      return state.timed;
+    }
+
+    // Same as step_generator::retarget_move
+    static uint32_t retarget_move(bool dir, uint32_t steps) {
+      uint32_t taken = 0;
+      mcu::disable_interrupt<Timer::irq>();
+      if (state.timed && !state.running) {
+        if (dir == state.direction) {
+          taken = state.ramp.extend(steps);
+          state.pulses_left = state.pulses_left + taken;
+        }
+        else {
+          taken = state.ramp.shorten(steps);
+          state.pulses_left = state.pulses_left - taken;
+        }
+      }
+      mcu::enable_interrupt<Timer::irq>();
+      return taken;
+    }
+
+    static inline void set_triggered(bool on) {
+      if (!state.timed && !state.inhibited) {
+        apply(write(Timer::sms, on ? 0b110 : 0));
+      }
+    }
+
+    // No backlash compensation: the receiver (a servo drive) is expected to
+    // take care of it
+    static void set_backlash(uint16_t, uint32_t) {}
+    static void compensate() {}
+    static inline bool is_compensating() { return false; }
+    static inline int32_t slack_offset() { return 0; }
+    static inline void take_up_slack(bool) {}
+    static inline void queue_step(bool) {}
+
+    static void start_move(bool dir, uint32_t steps, uint32_t max_speed, uint32_t acceleration) {
+      using namespace Kvasir;
+      if (steps == 0 || state.inhibited) {
+        return;
+      }
+      change_direction(dir);
+      state.ramp.start(steps, ClockFreq / TimedClockDiv, max_speed, acceleration);
+      state.pulses_left = steps;
+      state.timed = true;
+      apply(write(Timer::sms, 0));
+      apply(clear(Timer::opm),
+            set(Timer::arpe),
+            set(Timer::oc3pe),
+            set(Timer::oc4pe),
+            write(Timer::psc, TimedClockDiv - 1));
+      set_period(state.ramp.next());
+      apply(set(Timer::ug));
+      if (!state.ramp.done()) {
+        set_period(state.ramp.next());
+      }
+      apply(set(Timer::cen));
+    }
+
+    // Same as step_generator::start_run, a period without pulse has both
+    // channels frozen
+    static void start_run(uint16_t first_period) {
+      using namespace Kvasir;
+      if (state.inhibited) {
+        return;
+      }
+      change_direction(false);
+      state.pulse_active = false;
+      state.stopping = false;
+      state.running = true;
+      state.timed = true;
+      apply(write(Timer::oc3m, 0b000), write(Timer::oc4m, 0b000));
+      apply(write(Timer::sms, 0));
+      apply(clear(Timer::opm),
+            set(Timer::arpe),
+            set(Timer::oc3pe),
+            set(Timer::oc4pe),
+            write(Timer::psc, TimedClockDiv - 1));
+      set_run_period(first_period, false);
+      apply(set(Timer::ug));
+      apply(set(Timer::cen));
+    }
+
+    static void set_run_period(uint16_t period, bool pulse) {
+      state.pulse_next = pulse;
+      set_period(period);
+    }
+
+    static void stop_run() {
+      using namespace Kvasir;
+      apply(clear(Timer::uie));
+      if (state.running) {
+        state.stopping = true;
+        state.pulse_active = false;
+        apply(write(Timer::oc3m, 0b000), write(Timer::oc4m, 0b000));
+      }
+      apply(set(Timer::uie));
+    }
+
+    static inline bool is_running() {
+      return state.running;
+    }
+
+    // Same as step_generator::inhibit, both channels hold their level
+    static inline void inhibit() {
+      using namespace Kvasir;
+      state.inhibited = true;
+      apply(write(Timer::oc3m, 0b000), write(Timer::oc4m, 0b000)); // frozen
+      apply(clear(Timer::cen));
+      apply(write(Timer::sms, 0));
+    }
+
+    static void recover() {
+      using namespace Kvasir;
+      apply(clear(Timer::uie));
+      state.timed = false;
+      state.running = false;
+      state.stopping = false;
+      state.pulse_active = false;
+      apply(clear(Timer::arpe),
+            clear(Timer::oc3pe),
+            clear(Timer::oc4pe),
+            set(Timer::opm),
+            write(Timer::psc, ClockDiv - 1));
+      apply(set(Timer::ug));
+      select_channel();
+      setup_next_pulse();
+      state.inhibited = false;
+      apply(set(Timer::uie));
+    }
+
+  private:
+    // Forward from an even phase toggles A, from an odd one B. Reverse is the
+    // other way around.
+    static inline void select_channel() {
+      bool reverse = state.direction ^ state.direction_polarity;
+      bool a = ((state.phase & 1) != 0) == reverse;
+      apply(write(Timer::oc3m, a ? 0b011 : 0b000), // toggle on match or frozen
+            write(Timer::oc4m, a ? 0b000 : 0b011));
+    }
+
+    // Edge is near the end of the period, like the timed step pulse
+    static void set_period(uint16_t period) {
+      using namespace Kvasir;
+      period = std::max<uint16_t>(period, state.counts_edge_timed + min_count);
+      apply(write(Timer::arr, period - 1),
+            write(Timer::ccr3, period - state.counts_edge_timed),
+            write(Timer::ccr4, period - state.counts_edge_timed));
+    }
+
+    static void next_timed_pulse() {
+      if (--state.pulses_left == 0) {
+        end_move();
+      }
+      else if (!state.ramp.done()) {
+        set_period(state.ramp.next());
       }
     }
+
+    static void end_move() {
+      using namespace Kvasir;
+      apply(clear(Timer::cen));
+      apply(clear(Timer::arpe),
+            clear(Timer::oc3pe),
+            clear(Timer::oc4pe),
+            set(Timer::opm),
+            write(Timer::psc, ClockDiv - 1));
+      apply(set(Timer::ug));
+      apply(write(Timer::sms, 0b110));
+      state.timed = false;
+      setup_next_pulse();
+    }
+
+    // Edge at the (phase) delay, the counter runs on for the edge separation
+    static void setup_next_pulse() {
+      using namespace Kvasir;
+      uint16_t delay = state.counts_delay;
+      uint16_t at = std::max<uint16_t>(1, delay);
+      apply(write(Timer::ccr3, at),
+            write(Timer::ccr4, at),
+            write(Timer::arr, at + state.counts_edge));
+    }
   };
 
+  // Output personality of both axes, on the same pins: step/direction or A/B
+  // quadrature for servo drives and DROs
+  constexpr bool quadrature_output = false;
+
+  template <typename Timer, typename StepPin, typename DirPin>
+  using output_generator = std::conditional_t<quadrature_output,
+          quadrature_generator<Timer, StepPin, DirPin>,
+          step_generator<Timer, StepPin, DirPin>>;
+
+  using step_gen = output_generator<tim3_step_timer, mcu::pins::step_pin, mcu::pins::dir_pin>;
+  using step_gen2 = output_generator<tim4_step_timer, mcu::pins::step2_pin, mcu::pins::dir2_pin>;
+
   struct encoder {
     using pin_A = mcu::pins::enc_A;
     using pin_B = mcu::pins::enc_B;
@@ -134,7 +878,14 @@ namespace devices {
     
     using CounterValue = uint16_t;
 
-    static void init() {
+    inline static bool invert_dir = false;
+
+    // Quadrature (x4) or step/direction input. With step/direction, the
+    // counter is clocked by the rising edges of the step pin (A, TI1FP1) and
+    // the direction pin (B) sets the counting direction from its EXTI, so a
+    // direction change has to lead the next step by the interrupt latency.
+    // Compares, TRGO and the gear are the same in both modes.
+    static void init(bool step_dir = false, bool invert_dir_pin = false) {
       //Pins
       using namespace Kvasir;
       apply(write(pin_A::cr::cnf, gpio::PinConfig::Input_pullup_pulldown),
@@ -151,16 +902,44 @@ namespace devices {
             write(Tim1Ccmr1Input::cc2s, 0b01),
             write(Tim1Ccmr1Input::ic2f, input_filter),
             write(Tim1Ccmr2Output::oc3m, 0b001), // Set on match
-            write(Tim1Smcr::sms, 0b011),
             write(Tim1Cr2::mms, 0b110), // oc3ref is TRGO
             set(Tim1Ccer::cc3e), // enable ch3 output
             set(Tim1Bdtr::moe) // enable outputs
       );
+      if (step_dir) {
+        invert_dir = invert_dir_pin;
+        apply(write(Tim1Smcr::ts, 0b101), // TI1FP1
+              write(Tim1Smcr::sms, 0b111)); // external clock mode 1
+        update_direction();
+        apply(write(AfioExticr3::exti9, 0b0000)); // Port A
+        apply(set(ExtiRtsr::tr9), // both edges
+              set(ExtiFtsr::tr9),
+              set(ExtiImr::mr9));
+        mcu::enable_interrupt<IRQ::exti_9_5_irqn>();
+      }
+      else {
+        apply(write(Tim1Smcr::sms, 0b011)); // encoder mode 3
+      }
       apply(set(Tim1Cr1::cen));
       
       setup_cc_interrupt();
     }
 
+    // Step/direction input only
+    static inline bool is_direction_interrupt() {
+      return apply(read(Kvasir::ExtiPr::pr9));
+    }
+
+    static inline void process_direction_interrupt() {
+      apply(set(Kvasir::ExtiPr::pr9)); // write 1 to clear
+      update_direction();
+    }
+
+    static inline void update_direction() {
+      bool reverse = (apply(read(pin_B::idr)) != 0) == invert_dir;
+      apply(write(Kvasir::Tim1Cr1::dir, reverse)); // 1: counts down
+    }
+
     static void setup_cc_interrupt() {
       using namespace Kvasir;
       apply(set(Tim1Dier::cc3ie), set(Tim1Dier::cc4ie));
@@ -200,9 +979,331 @@ namespace devices {
       trigger_restore();
     }
 
+    static inline CounterValue get_fwd_compare() {
+      return apply(read(Kvasir::Tim1Ccr3::ccr3));
+    }
+
+    static inline CounterValue get_rev_compare() {
+      return apply(read(Kvasir::Tim1Ccr4::ccr4));
+    }
+
     static inline CounterValue get_count() {
       return apply(read(Kvasir::Tim1Cnt::cnt));
     }
+
+    static inline void disable_cc_interrupt() {
+      using namespace Kvasir;
+      apply(clear(Tim1Dier::cc3ie), clear(Tim1Dier::cc4ie));
+    }
+
+    static inline void enable_cc_interrupt() {
+      using namespace Kvasir;
+      apply(set(Tim1Dier::cc3ie), set(Tim1Dier::cc4ie));
+    }
+
+    // Counter is only 16 bits. Extended position is derived from the last
+    // tracked position plus the (signed) counter change since then, so
+    // track() needs to be called before the counter moves half of its range.
+    // Single 32 bit word -> reading it is atomic in any context.
+    volatile inline static int32_t position_base = 0;
+
+    static inline int32_t get_position() {
+      int32_t base = position_base;
+      return base + static_cast<int16_t>(get_count() - static_cast<CounterValue>(base));
+    }
+
+    static inline void track() {
+      position_base = get_position();
+    }
+
+    // Extended position of a counter value within half of the counter range
+    // of the current position
+    static inline int32_t extend(CounterValue value) {
+      int32_t now = get_position();
+      return now + static_cast<int16_t>(value - static_cast<CounterValue>(now));
+    }
+  };
+
+  // Microstep select pins of the leadscrew driver, levels given as a code
+  // (bit 0: MS1, bit 1: MS2). Set through BSRR: changed from the step
+  // interrupt, which can be preempted by a direction change on the same port.
+  struct microstep_select {
+    using ms1_pin = mcu::pins::ms1_pin;
+    using ms2_pin = mcu::pins::ms2_pin;
+
+    inline static uint8_t fine_code = 0, coarse_code = 0;
+
+    static void init(uint8_t fine, uint8_t coarse) {
+      using namespace Kvasir;
+      fine_code = fine;
+      coarse_code = coarse;
+      select(false);
+      apply(write(ms1_pin::cr::mode, gpio::PinMode::Output_2Mhz),
+            write(ms1_pin::cr::cnf, gpio::PinConfig::Output_push_pull),
+            write(ms2_pin::cr::mode, gpio::PinMode::Output_2Mhz),
+            write(ms2_pin::cr::cnf, gpio::PinConfig::Output_push_pull));
+    }
+
+    static inline void select(bool coarse) {
+      set(coarse ? coarse_code : fine_code);
+    }
+
+    static inline void set(uint8_t code) {
+      using namespace Kvasir;
+      static_assert(std::is_same_v<ms1_pin, gpio::Pin<gpio::PB, 13>> &&
+                    std::is_same_v<ms2_pin, gpio::Pin<gpio::PB, 14>>, "BSRR bits below");
+      const bool ms1 = (code & 1) != 0, ms2 = (code & 2) != 0;
+      apply(write(GpiobBsrr::bs13, ms1), write(GpiobBsrr::br13, !ms1),
+            write(GpiobBsrr::bs14, ms2), write(GpiobBsrr::br14, !ms2));
+    }
+  };
+
+  // Index (Z channel) of the encoder, captured on an EXTI line and latched
+  // against the extended encoder position
+  struct encoder_index {
+    using pin_Z = mcu::pins::enc_Z;
+
+    volatile inline static int32_t last_position = 0;
+    volatile inline static uint16_t pulse_count = 0;
+
+    static void init() {
+      using namespace Kvasir;
+      apply(write(pin_Z::cr::cnf, gpio::PinConfig::Input_pullup_pulldown),
+            set(pin_Z::bsrr));
+      apply(write(AfioExticr2::exti5, 0b0001)); // Port B
+      apply(set(ExtiRtsr::tr5), // rising edge
+            set(ExtiImr::mr5));
+      mcu::enable_interrupt<IRQ::exti_9_5_irqn>();
+    }
+
+    static inline bool is_pending() {
+      return apply(read(Kvasir::ExtiPr::pr5));
+    }
+
+    static inline void process_interrupt() {
+      last_position = encoder::get_position();
+      ++pulse_count;
+      apply(set(Kvasir::ExtiPr::pr5)); // write 1 to clear
+    }
+
+    // Consistent (position, count) pair of the last index pulse
+    static std::pair<int32_t, uint16_t> last_pulse() {
+      uint16_t count;
+      int32_t position;
+      do {
+        count = pulse_count;
+        position = last_position;
+      } while (count != pulse_count);
+      return {position, count};
+    }
+  };
+
+  // Quadrature input decoded in software. No timer with free encoder inputs
+  // is left (TIM1: spindle, TIM2: period, TIM3/TIM4: step outputs, the
+  // encoder pins of TIM4 carry the remapped USART), so it is decoded from both
+  // edges of both channels on their EXTI lines. Fine for a coarse encoder:
+  // every edge is one interrupt, a missed one (both channels changed) is
+  // counted as invalid.
+  template <typename PinA, typename PinB>
+  struct quadrature_input {
+    using pin_A = PinA;
+    using pin_B = PinB;
+
+    volatile inline static int32_t count = 0;
+    volatile inline static uint16_t invalid = 0;
+    inline static uint8_t phase = 0;
+    inline static bool reverse = false;
+
+    static inline void decode() {
+      const uint8_t now = read_phase();
+      switch ((now - phase) & 3) {
+        case 1: count = count + (reverse ? -1 : 1); break;
+        case 3: count = count + (reverse ? 1 : -1); break;
+        case 2: invalid = invalid + 1; break;
+      }
+      phase = now;
+    }
+
+  protected:
+    static void init_pins(bool invert) {
+      using namespace Kvasir;
+      reverse = invert;
+      apply(write(pin_A::cr::cnf, gpio::PinConfig::Input_pullup_pulldown),
+            set(pin_A::bsrr),
+            write(pin_B::cr::cnf, gpio::PinConfig::Input_pullup_pulldown),
+            set(pin_B::bsrr));
+      phase = read_phase();
+    }
+
+  private:
+    // Gray code (B, A) 00, 01, 11, 10 as 0 to 3
+    static inline uint8_t read_phase() {
+      const bool a = apply(read(pin_A::idr)), b = apply(read(pin_B::idr));
+      return b ? (a ? 2 : 3) : (a ? 1 : 0);
+    }
+  };
+
+  // Encoder on the leadscrew motor, to verify the steps made (EXTI10/11)
+  struct motor_encoder : quadrature_input<mcu::pins::motor_A, mcu::pins::motor_B> {
+    static void init(bool invert) {
+      using namespace Kvasir;
+      init_pins(invert);
+      apply(write(AfioExticr3::exti10, 0b0001), // Port B
+            write(AfioExticr3::exti11, 0b0001));
+      apply(set(ExtiRtsr::tr10), set(ExtiFtsr::tr10), // both edges
+            set(ExtiRtsr::tr11), set(ExtiFtsr::tr11),
+            set(ExtiImr::mr10), set(ExtiImr::mr11));
+      mcu::enable_interrupt<IRQ::exti_15_10_irqn>();
+    }
+
+    static inline void process_interrupt() {
+      apply(set(Kvasir::ExtiPr::pr10), set(Kvasir::ExtiPr::pr11)); // write 1 to clear
+      decode();
+    }
+  };
+
+  // Manual pulse generator (handwheel) for jogging, on EXTI3/4. Each line has
+  // its own interrupt, both decode.
+  struct handwheel : quadrature_input<mcu::pins::mpg_A, mcu::pins::mpg_B> {
+    static void init(bool invert) {
+      using namespace Kvasir;
+      init_pins(invert);
+      apply(write(AfioExticr1::exti3, 0b0000), // Port A
+            write(AfioExticr2::exti4, 0b0000));
+      apply(set(ExtiRtsr::tr3), set(ExtiFtsr::tr3), // both edges
+            set(ExtiRtsr::tr4), set(ExtiFtsr::tr4),
+            set(ExtiImr::mr3), set(ExtiImr::mr4));
+      mcu::enable_interrupt<IRQ::exti3_irqn>();
+      mcu::enable_interrupt<IRQ::exti4_irqn>();
+    }
+
+    // Called from both handlers, they do not preempt each other
+    static inline void process_interrupt() {
+      apply(set(Kvasir::ExtiPr::pr3), set(Kvasir::ExtiPr::pr4)); // write 1 to clear
+      decode();
+    }
+  };
+
+  // Backup domain registers (BKP_DR1 to DR8), kept over a system reset
+  // (brown-out, watchdog) as long as VDD or VBAT holds. The PVD interrupt
+  // comes when the supply falls below 2.9 V, the last chance to save.
+  struct backup {
+    static constexpr uint8_t size = 8;
+    using Words = std::array<uint16_t, size>;
+
+    static void init() {
+      using namespace Kvasir;
+      apply(set(PwrCr::dbp)); // write access to the backup domain
+    }
+
+    // After the snapshot is restored: a save before would overwrite it
+    static void enable_pvd() {
+      using namespace Kvasir;
+      apply(write(PwrCr::pls, 0b111), set(PwrCr::pvde));
+      apply(set(ExtiRtsr::tr16), set(ExtiImr::mr16)); // PVD output rises: VDD falls
+      mcu::enable_interrupt<IRQ::pvd_irqn>();
+    }
+
+    static void save(const Words& w) {
+      using namespace Kvasir;
+      apply(write(BkpDr1::d1, w[0]), write(BkpDr2::d2, w[1]),
+            write(BkpDr3::d3, w[2]), write(BkpDr4::d4, w[3]),
+            write(BkpDr5::d5, w[4]), write(BkpDr6::d6, w[5]),
+            write(BkpDr7::d7, w[6]), write(BkpDr8::d8, w[7]));
+    }
+
+    static Words load() {
+      using namespace Kvasir;
+      return {static_cast<uint16_t>(apply(read(BkpDr1::d1))),
+              static_cast<uint16_t>(apply(read(BkpDr2::d2))),
+              static_cast<uint16_t>(apply(read(BkpDr3::d3))),
+              static_cast<uint16_t>(apply(read(BkpDr4::d4))),
+              static_cast<uint16_t>(apply(read(BkpDr5::d5))),
+              static_cast<uint16_t>(apply(read(BkpDr6::d6))),
+              static_cast<uint16_t>(apply(read(BkpDr7::d7))),
+              static_cast<uint16_t>(apply(read(BkpDr8::d8)))};
+    }
+
+    static inline void clear_interrupt() {
+      apply(set(Kvasir::ExtiPr::pr16)); // write 1 to clear
+    }
+  };
+
+  // E-STOP input, normally closed to ground (with the pull-up, an open or
+  // broken circuit stops too). Its interrupt has the highest priority, the
+  // handler stops the step timers itself, within a microsecond of the edge.
+  struct estop {
+    using pin = mcu::pins::estop;
+
+    volatile inline static bool tripped = false;
+
+    static void init() {
+      using namespace Kvasir;
+      apply(write(pin::cr::cnf, gpio::PinConfig::Input_pullup_pulldown),
+            set(pin::bsrr));
+      apply(write(AfioExticr1::exti0, 0b0000)); // Port A
+      apply(set(ExtiRtsr::tr0), set(ExtiImr::mr0)); // opening the contact
+      mcu::enable_interrupt<IRQ::exti0_irqn>();
+      if (is_active()) {
+        tripped = true;
+      }
+    }
+
+    static inline bool is_active() {
+      return apply(read(pin::idr));
+    }
+
+    static inline void clear_interrupt() {
+      apply(set(Kvasir::ExtiPr::pr0)); // write 1 to clear
+    }
+  };
+
+  // Feed override potentiometer (ADC1 channel 5). ADC1 converts in continuous
+  // scan mode, the sequence is the same channel `Samples` times and DMA1
+  // channel 1 writes it round a buffer: no interrupt and no CPU time, the
+  // main loop takes the average.
+  struct feed_override {
+    using pin = mcu::pins::override_pot;
+    static constexpr uint8_t Samples = 8;
+    static constexpr unsigned full_scale = 4096 * Samples;
+
+    inline static volatile uint16_t samples[Samples]{};
+
+    static void init() {
+      using namespace Kvasir;
+      apply(write(pin::cr::mode, gpio::PinMode::Input),
+            write(pin::cr::cnf, gpio::PinConfig::Input_analog));
+      apply(write(Adc1Sqr1::l, Samples - 1),
+            write(Adc1Sqr3::sq1, 5), write(Adc1Sqr3::sq2, 5), write(Adc1Sqr3::sq3, 5),
+            write(Adc1Sqr3::sq4, 5), write(Adc1Sqr3::sq5, 5), write(Adc1Sqr3::sq6, 5),
+            write(Adc1Sqr2::sq7, 5), write(Adc1Sqr2::sq8, 5));
+      apply(write(Adc1Smpr2::smp5, 0b111), // 239.5 cycles, for a high impedance pot
+            set(Adc1Cr1::scan),
+            set(Adc1Cr2::cont),
+            set(Adc1Cr2::dma));
+      apply(write(Dma1Cpar1::pa, Adc1Dr::Addr::value),
+            write(Dma1Cmar1::ma, reinterpret_cast<unsigned>(&samples[0])),
+            write(Dma1Cndtr1::ndt, Samples),
+            write(Dma1Ccr1::msize, 0b01), // 16 bits
+            write(Dma1Ccr1::psize, 0b01),
+            set(Dma1Ccr1::minc),
+            set(Dma1Ccr1::circ));
+      apply(set(Dma1Ccr1::en));
+      apply(set(Adc1Cr2::adon)); // power up, then calibrate
+      mcu::delay_ms(1);
+      apply(set(Adc1Cr2::cal));
+      while (apply(read(Adc1Cr2::cal)));
+      apply(set(Adc1Cr2::adon)); // start, converts from here on
+    }
+
+    // Sum of the buffer, 0 to full_scale
+    static unsigned sum() {
+      unsigned sum = 0;
+      for (uint8_t i = 0; i < Samples; ++i) {
+        sum += samples[i];
+      }
+      return sum;
+    }
   };
 
   template <uint8_t Period_ms = 10, uint8_t Samples = 16>
@@ -245,18 +1346,23 @@ namespace devices {
     }
   };
   
+  // Input count period in CPU ticks, measured on PA1 (TIM2 CH2). PA1 is wired
+  // to the A channel of the encoder, a period of it contains 4 encoder
+  // changes. In step/direction mode PA1 carries STEP (wired to PA8 as well)
+  // and one period is one count.
   struct encoder_pulse_duration  {
     using pin_ch2 = mcu::pins::tim2_ch2;
 
-    static constexpr uint16_t Prescaler = 4; // Period of a single channel contains 4 encoder changes
+    static constexpr uint16_t QuadraturePrescaler = 4;
+    static constexpr uint16_t StepDirPrescaler = 1;
     
     volatile static inline uint16_t last_full_period = 0;
     
-    static void init() {
+    static void init(bool step_dir = false) {
       using namespace Kvasir;
       // Pin is input floating by default so no action necessary
       // Timer registers - Configure for "PWM Input Mode"
-      apply(write(Tim2Psc::psc, Prescaler - 1),
+      apply(write(Tim2Psc::psc, (step_dir ? StepDirPrescaler : QuadraturePrescaler) - 1),
             write(Tim2Ccmr1Input::cc1s, 0b10), // Source input 2
             write(Tim2Ccmr1Input::cc2s, 0b01), // Source input 2
             set(Tim2Ccer::cc2p), // invert polarity
@@ -296,8 +1402,10 @@ namespace devices {
   };
   
   
-  template<unsigned ClkFreq = mcu::CPU_Clock_Freq_Hz / 2, unsigned BaudRate = 115200 >
+  template<unsigned ClkFreq = mcu::clocks.pclk1(), unsigned BaudRate = 115200 > // USART2: APB1
   struct Serial2 {
+    static_assert(mcu::usart_baud_error(ClkFreq, BaudRate) < 20, "baud rate off by 2% or more");
+
     using pin_TX = mcu::pins::uart2_TX;
     //using pin_RX = mcu::pins::uart2_RX;
 
@@ -61,13 +61,18 @@ namespace Kvasir {
   //TODO: manually fill this up or find a reliable source to replace
   enum IRQ : nvic::irq_number_t {
     systick_irqn = -1,
+    pvd_irqn = 1,
+    exti0_irqn = 6,
+    exti3_irqn = 9,
+    exti4_irqn = 10,
     dma_channel5_irqn = 15,
     exti_9_5_irqn = 23,
     tim1_cc_irqn = 27,
     tim2_irqn = 28,
     tim3_irqn = 29,
     tim4_irqn = 30,
-    usart1_irqn = 37
+    usart1_irqn = 37,
+    exti_15_10_irqn = 40
   };
   
 }
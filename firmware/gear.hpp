@@ -1,66 +1,300 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+#include "cam.hpp"
+
 namespace gear {
 
+  // Extended (32 bit) encoder position, wraps around like the counter does.
+  // Distances are taken as signed differences (see distance()).
+  using Count = uint32_t;
+
+  constexpr int32_t distance(Count from, Count to) {
+    return static_cast<int32_t>(to - from);
+  }
+
+  constexpr int max_term = 1 << 29;
+
   struct State {
     int D, N; // pulse ratio : N/D
     int err = 0;
     int output_position = 0;
+    // Output steps per pulse (microstep switching), D is per step. Back to
+    // single steps, the output can be up to half a pulse off the line: it
+    // catches up one step per count (undelayed).
+    int step = 1;
   };
 
-  volatile State state = {4, 1};
-
   struct Jump {
-    uint16_t count;
-    uint16_t delta;
+    Count count;
+    uint32_t delta;
     int error;
+    int n;           // slope after the jump
+    uint8_t index;   // profile index (or cam segment) after the jump
+    Count origin;    // cam: start count of that segment
+  };
+
+  // Piecewise ratio: the slope (N) changes between `count` and `count + 1`.
+  // Error is carried over so the output line stays continuous. `adjust`
+  // (>= 0) moves the line back by a fraction of a count when crossed forward
+  // (and is given back when crossed in reverse).
+  struct Boundary {
+    Count count;
+    int n_before, n_after;
+    int adjust;
+  };
+
+  struct Profile {
+    static constexpr uint8_t capacity = 16;
+    std::array<Boundary, capacity> boundaries{};
+    volatile uint8_t size = 0;
+    volatile uint8_t index = 0; // boundaries before this index are behind
   };
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wnarrowing"  
   // Narrowing comes due to integer promotion in arithmetic operations
-  // k, the encoder count delta for the next step pulse, should fit within a short integer
+  // k, the encoder count delta for the next step pulse, is at most D / N.
+  // Terms are limited to max_term, so none of the products overflow.
 
-  inline Jump next_jump_forward(int d, int n, int e, uint16_t count) {
-    uint16_t k = (d - 2 * e + 2 * n - 1) / (2 * n);
-    return {count + k, k, e + k * n - d};
+  inline Jump next_jump_forward(int d, int n, int e, Count count) {
+    int32_t k = (d - 2 * e + 2 * n - 1) / (2 * n);
+    return {count + k, k, e + k * n - d, n};
   }
 
-  inline Jump next_jump_reverse(int d, int n, int e, uint16_t count) {
-    uint16_t k = 1 + ((d + 2 * e) / (2 * n));
-    return {count - k, k, e - k * n + d};
+  inline Jump next_jump_reverse(int d, int n, int e, Count count) {
+    int32_t k = 1 + ((d + 2 * e) / (2 * n));
+    return {count - k, k, e - k * n + d, n};
   }
 
-  struct Range {
-    Jump next{}, prev{};
-
-    void next_jump(bool dir, uint16_t count) {
-      int d = state.D, n = state.N, e = state.err;
-      if (!dir) {
-        next = next_jump_forward(d, n, e, count);
-        prev = {count - 1, 1u, next.error + d - n};
-      } else {
-        next = next_jump_reverse(d, n, e, count);
-        prev = {count + 1, 1u, next.error - d + n};
+  // Gear engine of one output axis. Axes share the input (encoder) and have
+  // their own ratio, error term and profile.
+  template <uint8_t Axis>
+  struct Engine {
+    inline static volatile State state = {4, 1};
+    inline static Profile profile{};
+    inline static cam::Table cam{}; // replaces the ratio (and profile) if not empty
+    inline static volatile Count cam_origin = 0;
+
+    struct Range {
+      Jump next{}, prev{};
+
+      // Jumps are computed from the state at `count`, where a step was just made.
+      // Crossing profile boundaries is resolved here, outside of the latency
+      // critical path. Resulting slope and profile index are kept in the jump
+      // and only take effect when (and if) the jump is made.
+      void next_jump(bool dir, Count count) {
+        int d = state.D * state.step, n = state.N, e = state.err;
+        uint8_t i = profile.index, size = profile.size;
+        if (cam.size > 0) {
+          Count origin = cam_origin;
+          if (!dir) {
+            next = cam_forward(d, n, e, count, i, origin);
+            prev = cam_undo_forward(d, n, e, count, i, origin);
+          } else {
+            next = cam_reverse(d, n, e, count, i, origin);
+            prev = cam_undo_reverse(d, n, e, count, i, origin);
+          }
+          return;
+        }
+        if (!dir) {
+          next = forward(d, n, e, count, i, size);
+          prev = undo_forward(d, n, e, count, i);
+          if (distance(count, next.count) < 1) { // catching up, see State::step
+            next = {count + 1, 1u, e + n - d, n, i};
+          }
+        } else {
+          next = reverse(d, n, e, count, i);
+          prev = undo_reverse(d, n, e, count, i, size);
+          if (distance(next.count, count) < 1) {
+            next = {count - 1, 1u, e - n + d, n, i};
+          }
+        }
+      }
+
+    private:
+      static bool is_at(Count count, uint8_t i, uint8_t size) {
+        return (i < size) && (profile.boundaries[i].count == count);
+      }
+
+      static Jump forward(int d, int n, int e, Count count, uint8_t i, uint8_t size) {
+        auto result = next_jump_forward(d, n, e, count);
+        for (; i < size; ++i) {
+          const auto& b = profile.boundaries[i];
+          int32_t ahead = distance(count, b.count);
+          if (ahead < 0 || distance(b.count, result.count) <= 0) {
+            break;
+          }
+          e += n * ahead - b.adjust;
+          n = b.n_after;
+          count = b.count;
+          result = next_jump_forward(d, n, e, count);
+        }
+        result.index = i;
+        return result;
+      }
+
+      static Jump reverse(int d, int n, int e, Count count, uint8_t i) {
+        auto result = next_jump_reverse(d, n, e, count);
+        for (; i > 0; --i) {
+          const auto& b = profile.boundaries[i - 1];
+          int32_t behind = distance(b.count, count); // boundary is between b.count + 1 and b.count
+          if (behind < 1 || distance(result.count, b.count) < 0) {
+            break;
+          }
+          e += b.adjust - n * behind;
+          n = b.n_before;
+          count = b.count;
+          if (2 * e < -d) { // step right after crossing
+            result = {count, 0, e + d, n};
+          }
+          else {
+            result = next_jump_reverse(d, n, e, count);
+          }
+        }
+        result.index = i;
+        return result;
+      }
+
+      // Reverse step back to count - 1, undoing the step made at count
+      static Jump undo_forward(int d, int n, int e, Count count, uint8_t i) {
+        Count c = count - 1;
+        if (i > 0 && profile.boundaries[i - 1].count == c) {
+          const auto& b = profile.boundaries[i - 1];
+          return {c, 1u, e + d - n + b.adjust, b.n_before, i - 1};
+        }
+        return {c, 1u, e + d - n, n, i};
+      }
+
+      // Forward step to count + 1, undoing the step made at count
+      static Jump undo_reverse(int d, int n, int e, Count count, uint8_t i, uint8_t size) {
+        Count c = count + 1;
+        if (is_at(count, i, size)) {
+          const auto& b = profile.boundaries[i];
+          return {c, 1u, e - d + b.n_after - b.adjust, b.n_after, i + 1};
+        }
+        return {c, 1u, e - d + n, n, i};
       }
+
+      // Cam: state is in segment i, which starts at `origin`. Leaving the
+      // segment without a step is one lookup, whatever is crossed.
+      static Jump cam_forward(int d, int n, int e, Count count, uint8_t i, Count origin) {
+        const Count end = origin + cam.segments[i].length;
+        if (n > 0) {
+          auto result = next_jump_forward(d, n, e, count);
+          int32_t before_end = distance(result.count, end);
+          if (before_end > 0) {
+            result.index = i;
+            result.origin = origin;
+            return result;
+          }
+          if (before_end == 0) { // next segment's slope from here on
+            result.index = cam.next(i);
+            result.n = cam.segments[result.index].n;
+            result.origin = end;
+            return result;
+          }
+        }
+        const auto& t = cam.segments[cam.next(i)].forward;
+        Count c = end + t.delta;
+        return {c, c - count, t.error, cam.segments[t.segment].n, t.segment, end + t.origin_delta};
+      }
+
+      static Jump cam_reverse(int d, int n, int e, Count count, uint8_t i, Count origin) {
+        if (n > 0) {
+          auto result = next_jump_reverse(d, n, e, count);
+          if (distance(origin, result.count) >= 0) {
+            result.index = i;
+            result.origin = origin;
+            return result;
+          }
+        }
+        const auto& t = cam.segments[i].reverse;
+        Count c = origin - t.delta;
+        return {c, count - c, t.error, cam.segments[t.segment].n, t.segment, origin - t.origin_delta};
+      }
+
+      static Jump cam_undo_forward(int d, int n, int e, Count count, uint8_t i, Count origin) {
+        Count c = count - 1;
+        if (count == origin) { // step back into the previous segment
+          uint8_t j = cam.prev(i);
+          const auto& s = cam.segments[j];
+          return {c, 1u, e + d - s.n, s.n, j, origin - s.length};
+        }
+        return {c, 1u, e + d - n, n, i, origin};
+      }
+
+      static Jump cam_undo_reverse(int d, int n, int e, Count count, uint8_t i, Count origin) {
+        Count c = count + 1;
+        const Count end = origin + cam.segments[i].length;
+        if (c == end) {
+          uint8_t j = cam.next(i);
+          return {c, 1u, e - d + n, cam.segments[j].n, j, end};
+        }
+        return {c, 1u, e - d + n, n, i, origin};
+      }
+    };
+
+    inline static Range range{};
+
+    // Drops the profile and goes back to the slope before it (gear must be idle)
+    static void clear_profile() {
+      if (profile.size > 0) {
+        state.N = profile.boundaries[0].n_before;
+      }
+      profile.size = 0;
+      profile.index = 0;
     }
-  };
-#pragma GCC diagnostic pop
 
-  Range range;
+    // Makes the jump: state from here on is the one at the jump's count
+    static void take(const Jump& jump) {
+      state.err = jump.error;
+      state.N = jump.n;
+      profile.index = jump.index;
+      cam_origin = jump.origin;
+    }
 
-  template <typename RationalNumber>
-  void configure(const RationalNumber& ratio, uint16_t start_position) {
-    state.D = ratio.denominator();
-    state.N = ratio.numerator();
-    state.err = 0;
-    range.next = next_jump_forward(ratio.denominator(), ratio.numerator(), 0, start_position);
-    range.prev = next_jump_reverse(ratio.denominator(), ratio.numerator(), 0, start_position);
-  }
+    // Scale multiplies both terms of the ratio: same slope, finer error steps
+    template <typename RationalNumber>
+    static void configure(const RationalNumber& ratio, Count start_position, int scale = 1) {
+      int d = ratio.denominator() * scale, n = ratio.numerator() * scale;
+      cam.size = 0;
+      profile.size = 0;
+      profile.index = 0;
+      state.step = 1;
+      state.D = d;
+      state.N = n;
+      state.err = 0;
+      range.next = next_jump_forward(d, n, 0, start_position);
+      range.prev = next_jump_reverse(d, n, 0, start_position);
+    }
   
-  inline unsigned phase_delay(uint16_t input_period, int e) {
-    if (e < 0) e = -e;
-    return (input_period * e) / (state.N);
-  }
+    // Cam (already built) with its period starting at `origin`, where the
+    // output is at a step and the error is zero. Range is computed from there.
+    static void start_cam(Count origin) {
+      profile.size = 0;
+      profile.index = 0;
+      cam_origin = origin;
+      state.step = 1;
+      state.D = cam.d;
+      state.N = cam.segments[0].n;
+      state.err = 0;
+      range.next_jump(false, origin);
+    }
+
+    // Delay of the step behind the count, clamped to `limit` (the range of
+    // the step timer). Products are 64 bit, the error is up to D * step.
+    static unsigned phase_delay(uint16_t input_period, int e, unsigned limit) {
+      if (state.N == 0) return 0; // cam dwell
+      const uint64_t error = (e < 0) ? -int64_t(e) : e;
+      if (2 * error > uint64_t(state.D) * state.step) return 0; // catching up
+      return std::min<uint64_t>((uint64_t(input_period) * error) / state.N, limit);
+    }
+  };
+#pragma GCC diagnostic pop
   
 }
\ No newline at end of file
@@ -12,8 +12,9 @@
 
 namespace devices {
   
-  template<unsigned ClkFreq = mcu::CPU_Clock_Freq_Hz, unsigned BaudRate = 115200 >
+  template<unsigned ClkFreq = mcu::clocks.pclk2(), unsigned BaudRate = 115200 > // USART1: APB2
   struct hmi {
+    static_assert(mcu::usart_baud_error(ClkFreq, BaudRate) < 20, "baud rate off by 2% or more");
 
     enum class hmi_event : uint8_t {
       none = 0,
@@ -21,6 +22,15 @@ namespace devices {
       btn_thread_minus,
       btn_thread_plus,
       btn_thread_select,
+      btn_engage,
+      btn_disengage,
+      btn_next_start,
+      btn_return,
+      btn_cycle,
+      btn_cam,
+      btn_rotary,
+      btn_index,
+      btn_jog_multiplier,
       btn_menu,
       btn_settings,
       btn_p3_cancel,
@@ -79,6 +89,11 @@ namespace devices {
       }
     }
 
+    // Reported ready since the reset
+    static inline bool is_connected() {
+      return connected;
+    }
+
     static void send_rpm(uint16_t val) {
       send_packet(std::sprintf(out_buf.begin(), "n0.val=%u", val));
     }
@@ -91,6 +106,73 @@ namespace devices {
       send_packet(e - b);
     }
     
+    // Threading cycle progress, pass and start are zero based
+    static void send_cycle_progress(unsigned pass, unsigned passes, unsigned start, unsigned starts) {
+      if (pass >= passes) {
+        send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Done %u\"", passes));
+      }
+      else if (starts > 1) {
+        send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"%u/%u S%u\"", pass + 1, passes, start + 1));
+      }
+      else {
+        send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"%u/%u\"", pass + 1, passes));
+      }
+    }
+    
+    // Threading cycle waits for the cycle button: tool withdrawn (retract)
+    // or fed in for the next pass
+    static void send_cycle_wait(bool retract) {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"%s: Cycle\"", retract ? "Retract" : "Infeed"));
+    }
+    
+    // Cam pieces rejected by cam::Table::build, cam mode is not entered
+    static void send_cam_invalid() {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Cam invalid\""));
+    }
+    
+    // Pitch corrections rejected by pitch::Map::build, the leadscrew runs
+    // without them
+    static void send_pitch_map_invalid() {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Pitch map\""));
+    }
+    
+    // More table steps per hob revolution than encoder counts, rotary mode is
+    // not entered
+    static void send_hobbing_invalid() {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Hob ratio\""));
+    }
+    
+    static void send_division(unsigned division, unsigned divisions) {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"%u/%u\"", division, divisions));
+    }
+    
+    // Stopped on the motor encoder: steps behind (negative: ahead)
+    static void send_following_error(int steps) {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Lost %d\"", steps));
+    }
+
+    static void send_boot_time(unsigned microseconds) {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Boot %u.%03ums\"",
+              microseconds / 1000, microseconds % 1000));
+    }
+
+    static void send_estop() {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"E-STOP\""));
+    }
+
+    static void send_jog_multiplier(unsigned steps) {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Jog x%u\"", steps));
+    }
+
+    static void send_feed_override(unsigned percent) {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Feed %u%%\"", percent));
+    }
+
+    // Step accounting found the leadscrew off the gear line (count so far)
+    static void send_desync(unsigned count) {
+      send_packet(std::sprintf(out_buf.begin(), "t3.txt=\"Desync %u\"", count));
+    }
+    
     // A hacky implementation for a *listbox* like UI using buttons
     template <typename ThreadValidation>
     static int16_t select_thread(int16_t selected_index, ThreadValidation f_thread) {
@@ -254,6 +336,15 @@ namespace devices {
           case 5: return hmi_event::btn_thread_select;
           case 6: return hmi_event::btn_thread_minus;
           case 7: return hmi_event::btn_thread_plus;
+          case 18: return hmi_event::btn_engage;
+          case 19: return hmi_event::btn_disengage;
+          case 20: return hmi_event::btn_next_start;
+          case 21: return hmi_event::btn_return;
+          case 22: return hmi_event::btn_cycle;
+          case 23: return hmi_event::btn_cam;
+          case 24: return hmi_event::btn_rotary;
+          case 25: return hmi_event::btn_index;
+          case 26: return hmi_event::btn_jog_multiplier;
           case 17: return hmi_event::btn_menu;
           default:
             return hmi_event::none;
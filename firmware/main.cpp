@@ -1,5 +1,6 @@
 #include <limits>
 #include <algorithm>
+#include <atomic>
 
 // Kvasir imports
 #include <Chip/STM32F103xx.hpp>
@@ -10,6 +11,11 @@
 #include "devices.hpp"
 #include "hmi.hpp"
 #include "gear.hpp"
+#include "axes.hpp"
+#include "pitch.hpp"
+#include "phase.hpp"
+#include "monitor.hpp"
+#include "cycle.hpp"
 #include "threads.hpp"
 #include "thread_list.hpp"
 #include "configuration.hpp"
@@ -32,12 +38,32 @@ namespace control {
     stopped,
     in_sync,
     ramping,
+    engaging, // waiting for the spindle phase of the first pass
+    returning, // rapid move back to the start of the pass
+    retracting, // tool withdrawn after a pass, before the return
+    infeeding, // tool fed in after the return, before the next pass
   };
   
   volatile State state = State::in_sync; // TODO: default should be OFF
+  State after_return = State::engaging;
 }
 
+void save_snapshot();
+
 extern "C" { // interrupt handlers
+  void PVD_IRQHandler() { // supply failing, the reset comes next
+    devices::backup::clear_interrupt();
+    save_snapshot();
+  }
+
+  void EXTI0_IRQHandler() { // E-STOP, highest priority: outputs first
+    devices::step_gen::inhibit();
+    devices::step_gen2::inhibit();
+    devices::encoder::disable_cc_interrupt();
+    devices::estop::clear_interrupt();
+    devices::estop::tripped = true;
+  }
+
   void SysTick_Handler() { // Called every 1 ms
     using rpm_sampler = devices::rpm_counter<>;
     using namespace systick_state;
@@ -53,33 +79,27 @@ extern "C" { // interrupt handlers
         rpm_sample_prescale_count = psc;
       }
     }  
+    devices::encoder::track();
     if (((++mcu::milliseconds) & 1023) == 0) {
       mcu::toggle_led();
     }
   }
 
   void TIM1_CC_IRQHandler() {
-    using namespace devices;
-    auto enc = encoder::get_count();
-    bool dir = step_gen::get_direction();
-    const bool fwd = encoder::is_cc_fwd_interrupt();
-    encoder::clear_cc_interrupt();
-    using namespace gear;
-    if (fwd) {
-      encoder::trigger_clear();
-      state.err = range.next.error;
-      range.next_jump(dir, enc);
-      step_gen::set_delay(phase_delay(encoder_pulse_duration::last_duration(), range.next.error));
-      encoder::trigger_restore();
-    }
-    else { // Change direction, setup delayed pulse and do manual trigger     
-      dir = !dir;
-      step_gen::change_direction(dir);
-      encoder::trigger_manual_pulse();
-      state.err = range.prev.error;
-      range.next_jump(dir, enc);
-    }
-    encoder::update_channels(range.next.count, range.prev.count);
+    if (devices::step_gen::is_running()) { // NCO mode, the compare observes the input
+      phase::observe();
+      return;
+    }
+    axes::all::process_cc_interrupt();
+  }
+
+  void EXTI9_5_IRQHandler() { // direction first, it has to lead the next step
+    if (devices::encoder::is_direction_interrupt()) {
+      devices::encoder::process_direction_interrupt();
+    }
+    if (devices::encoder_index::is_pending()) {
+      devices::encoder_index::process_interrupt();
+    }
   }
 
   void TIM2_IRQHandler() {
@@ -87,9 +107,43 @@ extern "C" { // interrupt handlers
   }
 
   void TIM3_IRQHandler() {
-    using devices::step_gen;
-    step_gen::process_interrupt();
-    gear::state.output_position += step_gen::get_direction() ? 1 : -1;
+    using axis = axes::leadscrew;
+    const int moved = axis::step_gen::process_interrupt(); // backlash is not counted
+    const int32_t lost = axis::lost_taken;
+    int32_t position = axis::gear::state.output_position - (lost - axis::lost_counted);
+    axis::lost_counted = lost;
+    const int steps = moved * axis::pulse_step;
+    position += steps;
+    axis::gear::state.output_position = position;
+    if (steps != 0) {
+      cycle::on_step(position, steps);
+    }
+    if (axis::step_changed) { // pulse in flight at the switch is done
+      axis::pulse_step = axis::gear::state.step;
+      axis::step_changed = false;
+      devices::microstep_select::select(axis::pulse_step > 1);
+    }
+    if (axis::step_gen::is_running()) { // NCO mode
+      auto next = phase::follower.update(position);
+      axis::step_gen::set_run_period(next.period, next.pulse);
+    }
+  }
+
+  void EXTI15_10_IRQHandler() {
+    devices::motor_encoder::process_interrupt();
+  }
+
+  void EXTI3_IRQHandler() {
+    devices::handwheel::process_interrupt();
+  }
+
+  void EXTI4_IRQHandler() {
+    devices::handwheel::process_interrupt();
+  }
+
+  void TIM4_IRQHandler() {
+    using axis = axes::cross_slide;
+    axis::gear::state.output_position += axis::step_gen::process_interrupt();
   }
 
   void USART1_IRQHandler() {
@@ -98,7 +152,44 @@ extern "C" { // interrupt handlers
 } // extern "C"
 
 Configuration config{};
+cycle::Counter passes{};
+pitch::Map pitch_map{};
+bool pitch_map_valid = true; // corrections rejected by pitch::Map::build, told on the display
 
+// Retract and infeed between passes: the cross slide move, or the prompt
+// to the operator, is started once, then it is waited for (see process_cycle)
+bool cycle_step_started = false;
+bool cycle_confirmed = false; // cycle button pressed at the prompt
+int32_t cut_cross = 0;        // cross slide position of the next pass
+
+void stop_cycle() {
+  passes.stop();
+  cycle::disarm_stop();
+  cycle_step_started = false;
+  cycle_confirmed = false;
+}
+
+// Feed override, see update_feed_override()
+constexpr int override_denominator = 32;
+constexpr unsigned no_reading = 2 * devices::feed_override::full_scale;
+int feed_scale = override_denominator;
+unsigned override_reading = no_reading;
+
+void configure_gear(int32_t start_position) {
+  axes::leadscrew::ratio_changed = false;
+  feed_scale = override_denominator;
+  override_reading = no_reading;
+  if (config.rotary) { // hob: the table follows the spindle, no taper
+    axes::leadscrew::gear::configure(config.calculate_hobbing_ratio(), start_position);
+    return;
+  }
+  auto pr = config.calculate_ratio();
+  axes::leadscrew::gear::configure(pr, start_position,
+          phase::gear_scale(config.thread.starts, pr.numerator(), config.phase_period()));
+  if (config.use_taper()) {
+    axes::cross_slide::gear::configure(config.calculate_cross_ratio(), start_position);
+  }
+}
 
 void change_thread() {
   // TODO:
@@ -110,43 +201,573 @@ void change_thread() {
   //    if ramping -> re-adjust target speed
   // setup acceleration settings in acceleration device
   // switch step_gen to trigger from the accelerator
-  auto pr = config.calculate_ratio();
-  gear::configure(pr, devices::encoder::get_count());
+  stop_cycle();
+  configure_gear(devices::encoder::get_position());
+  phase::reference.reset(); // new thread, new groove
   devices::hmi<>::send_thread_info(config.thread);
 }
 
+bool cam_mode() {
+  return axes::leadscrew::gear::cam.size > 0;
+}
+
+// Cam mode replaces the thread's ratio (engaged with the engage button), the
+// thread's ratio is back when it is left. Only while stopped.
+void toggle_cam() {
+  if (cam_mode()) {
+    configure_gear(devices::encoder::get_position());
+  }
+  else if (!axes::leadscrew::gear::cam.build(config.cam_pieces.data(), config.cam_size)) {
+    devices::hmi<>::send_cam_invalid();
+  }
+}
+
+// Oscillator in place of the compares: plain threads only (no cam, taper or
+// rotary table)
+bool use_nco() {
+  return config.nco_output && !cam_mode() && !config.use_taper() && !config.rotary;
+}
+
+// Scales the leadscrew ratio by the override potentiometer, feed_scale / 32.
+// In sync on a plain feed only (no cam, taper, rotary table or NCO), threads
+// keep the exact ratio. The reading has to move by 1/64 of the range, so
+// noise does not step the ratio back and forth.
+void update_feed_override() {
+  using axis = axes::leadscrew;
+  using devices::feed_override;
+  if (!config.feed || !config.feed_override || control::state != control::State::in_sync ||
+      cam_mode() || use_nco() || config.use_taper() || config.rotary) {
+    return;
+  }
+  const unsigned reading = feed_override::sum();
+  const unsigned margin = feed_override::full_scale / 64;
+  if (reading + margin > override_reading && reading < override_reading + margin) {
+    return;
+  }
+  const unsigned span = config.override_max - config.override_min;
+  const auto r = config.calculate_ratio();
+  // Below one step per count (see Configuration::verify_ratio)
+  const int fastest = (uint64_t(r.denominator()) * override_denominator - 1) / r.numerator();
+  const int scale = std::min<int>(fastest, config.override_min +
+          (reading * span + feed_override::full_scale / 2) / feed_override::full_scale);
+  if (scale != feed_scale) {
+    const Configuration::WideRational scaled{uint64_t(r.numerator()) * scale,
+                                             uint64_t(r.denominator()) * override_denominator};
+    if (!Configuration::verify_ratio(scaled) ||
+        !axis::request_ratio(static_cast<int>(scaled.numerator()), static_cast<int>(scaled.denominator()))) {
+      return; // next time
+    }
+    feed_scale = scale;
+    devices::hmi<>::send_feed_override(100 * scale / override_denominator);
+  }
+  override_reading = reading;
+}
+
+// Switches the leadscrew driver's microsteps by the output step rate, with
+// hysteresis. Coarse steps start at a full step (geared only).
+void update_microsteps() {
+  using axis = axes::leadscrew;
+  const int coarse = config.coarse_step();
+  if (coarse == 1 || config.backlash_steps != 0 || control::state != control::State::in_sync ||
+      cam_mode() || use_nco() || axis::gear::state.D > gear::max_term / coarse) {
+    return;
+  }
+  uint16_t period = devices::encoder_pulse_duration::last_duration();
+  uint64_t rate = (period == 0) ? 0 :
+          mcu::CPU_Clock_Freq_Hz * axis::gear::state.N / (uint64_t(period) * axis::gear::state.D);
+  if (rate > config.coarse_above) {
+    axis::request_step(coarse, config.stepper_micro_steps);
+  }
+  else if (rate < config.fine_below) {
+    axis::request_step(1, 1);
+  }
+}
+
+// Back to single microsteps once disengaged, any coarse step is on the fine
+// grid. Phase engagement and moves are in single steps.
+void fine_steps() {
+  using axis = axes::leadscrew;
+  if (config.coarse_step() == 1) {
+    return;
+  }
+  while (!axis::step_gen::is_idle());
+  axis::request_step(1, 1);
+  axis::gear::state.step = 1;
+  axis::pulse_step = 1;
+  axis::step_changed = false;
+  devices::microstep_select::select(false);
+}
+
+// Motor encoder: following error of the leadscrew in microsteps, the output
+// position (plus the backlash taken up) against the measured one. While in
+// sync the gear makes up lost steps, one correction at a time, once the
+// error is beyond the lag of a loaded motor. Beyond the limit the cycle is
+// stopped and the monitor restarts from there. Output and encoder count are
+// sampled together: taken again if either interrupt came in between.
+int32_t motor_offset = 0;
+
+void verify_position() {
+  using axis = axes::leadscrew;
+  using devices::motor_encoder;
+  if (!config.motor_encoder) {
+    return;
+  }
+  int32_t count, output;
+  do {
+    count = motor_encoder::count;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    output = axis::gear::state.output_position + axis::step_gen::slack_offset();
+    std::atomic_signal_fence(std::memory_order_acquire);
+  } while (count != motor_encoder::count || output != axis::gear::state.output_position +
+           axis::step_gen::slack_offset());
+  const int64_t steps_per_rev = int64_t(config.stepper_full_steps) * config.stepper_micro_steps;
+  const int32_t measured = static_cast<int32_t>(count * steps_per_rev / config.motor_encoder_counts);
+  const int32_t error = output - measured - motor_offset;
+  const int32_t size = (error < 0) ? -error : error;
+  if (size > config.following_limit) {
+    if (control::state == control::State::in_sync || control::state == control::State::engaging) {
+      stop_cycle();
+      phase::disengage();
+      fine_steps();
+      control::state = control::State::stopped;
+    }
+    motor_offset += error;
+    devices::hmi<>::send_following_error(error);
+  }
+  else if (size > config.correction_deadband() && control::state == control::State::in_sync &&
+           !cam_mode() && !use_nco() && axis::lost_requested == axis::lost_counted) {
+    axis::lost_requested = axis::lost_requested + error;
+  }
+}
+
+// Snapshot in the backup registers (see devices::backup): output positions
+// and the selected thread, saved by the PVD interrupt and every 128 ms (a
+// watchdog reset has no warning). Restored at start, the machine is back on
+// the same thread with the outputs where they were. The spindle angle is
+// lost (the encoder counts from zero) and so is the thread phase, it is
+// taken again on engagement.
+constexpr uint16_t snapshot_version = 0xD601;
+uint32_t snapshot_saved = 0;
+
+// Fletcher checksum over the data words, seeded with the version (erased
+// registers do not pass)
+std::array<uint16_t, 2> snapshot_check(const devices::backup::Words& w) {
+  uint32_t a = snapshot_version, b = 0;
+  for (uint8_t i = 0; i < devices::backup::size - 2; ++i) {
+    a = (a + w[i]) % 0xFFFF;
+    b = (b + a) % 0xFFFF;
+  }
+  return {static_cast<uint16_t>(a), static_cast<uint16_t>(b)};
+}
+
+void save_snapshot() {
+  const uint32_t lead = axes::leadscrew::gear::state.output_position;
+  const uint32_t cross = axes::cross_slide::gear::state.output_position;
+  devices::backup::Words w{static_cast<uint16_t>(lead), static_cast<uint16_t>(lead >> 16),
+          static_cast<uint16_t>(cross), static_cast<uint16_t>(cross >> 16),
+          static_cast<uint16_t>(config.pitch_list_index), config.start_index};
+  const auto check = snapshot_check(w);
+  w[6] = check[0];
+  w[7] = check[1];
+  devices::backup::save(w);
+}
+
+void update_snapshot() {
+  const uint32_t now = mcu::milliseconds;
+  if (now - snapshot_saved < 128) {
+    return;
+  }
+  snapshot_saved = now;
+  mcu::disable_interrupt<Kvasir::IRQ::pvd_irqn>(); // saved whole by one or the other
+  save_snapshot();
+  mcu::enable_interrupt<Kvasir::IRQ::pvd_irqn>();
+}
+
+bool restore_snapshot() {
+  const auto w = devices::backup::load();
+  const auto check = snapshot_check(w);
+  const int16_t index = static_cast<int16_t>(w[4]);
+  if (check[0] != w[6] || check[1] != w[7] || index < 0 || index >= threads::pitch_list_size ||
+      config.verify_thread(index, phase::gear_scale) != Configuration::thread_OK) {
+    return false;
+  }
+  config.select_thread(index);
+  config.start_index = (w[5] < config.thread.starts) ? w[5] : 0;
+  axes::leadscrew::gear::state.output_position = static_cast<int32_t>(w[0] | (uint32_t(w[1]) << 16));
+  axes::cross_slide::gear::state.output_position = static_cast<int32_t>(w[2] | (uint32_t(w[3]) << 16));
+  return true;
+}
+
+// Boot milestones in microseconds (mcu::microseconds), to measure the boot
+// path: readable with a debugger, the time to a live gear is shown once the
+// display is up.
+namespace boot {
+  enum Milestone : uint8_t {
+    main_entered,
+    gear_live,   // step generators, gear and encoder running
+    hmi_reset,   // display reset sent
+    hmi_ready,   // display reported ready (or timed out)
+    milestones
+  };
+
+  std::array<uint32_t, milestones> at{};
+
+  void mark(Milestone m) {
+    at[m] = mcu::microseconds();
+  }
+}
+
+// The display connects while the gear already runs: it is reset at start
+// and gets its first update once it reports ready, or after 200 ms (the PC
+// simulator does not report). Also while an E-STOP is latched, whose state
+// (sent before the display was up) is sent again.
+bool display_started = false;
+
+void start_display() {
+  using display = devices::hmi<>;
+  if (display_started ||
+      (!display::is_connected() && mcu::milliseconds - boot::at[boot::hmi_reset] / 1000 < 200)) {
+    return;
+  }
+  display_started = true;
+  boot::mark(boot::hmi_ready);
+  ui::rpm_report = true;
+  display::send_thread_info(config.thread);
+  display::send_boot_time(boot::at[boot::gear_live]);
+  if (!pitch_map_valid) {
+    display::send_pitch_map_invalid();
+  }
+  if (config.estop && devices::estop::tripped) {
+    display::send_estop();
+  }
+}
+
+// Step accounting of the leadscrew (see monitor.hpp), every 128 ms. Reported
+// once per engagement, the gear keeps running.
+monitor::Accounting<axes::leadscrew> accounting{};
+uint32_t accounting_checked = 0;
+
+void check_accounting() {
+  const uint32_t now = mcu::milliseconds;
+  if (now - accounting_checked < 128) {
+    return;
+  }
+  accounting_checked = now;
+  const bool valid = control::state == control::State::in_sync && axes::leadscrew::enabled &&
+          !cam_mode() && !use_nco();
+  if (accounting.check(valid)) {
+    devices::hmi<>::send_desync(accounting.errors);
+  }
+}
+
+// Handwheel jogging, only while stopped: detents (times the multiplier) move
+// the end of the running jog within its ramp, what is left starts the next
+// one. Steps are counted by the step interrupt as any other move, so the
+// phase reference still holds afterwards. Turns while not stopped are
+// dropped.
+int32_t jog_count = 0; // handwheel counts taken
+int32_t jog_pending = 0;
+uint8_t jog_multiplier = 0;
+bool jogging = false;
+
+void process_jog() {
+  using devices::step_gen;
+  if (!config.handwheel) {
+    return;
+  }
+  const int32_t detents = (devices::handwheel::count - jog_count) / config.handwheel_counts;
+  jog_count += detents * config.handwheel_counts;
+  jogging = jogging && step_gen::is_moving();
+  if (control::state != control::State::stopped) {
+    jog_pending = 0;
+    return;
+  }
+  jog_pending += detents * config.jog_multipliers[jog_multiplier];
+  if (jog_pending == 0) {
+    return;
+  }
+  const bool dir = jog_pending < 0;
+  const uint32_t steps = dir ? -jog_pending : jog_pending;
+  if (jogging) {
+    const int32_t taken = step_gen::retarget_move(dir, steps);
+    jog_pending += dir ? taken : -taken;
+  }
+  else if (step_gen::is_idle()) {
+    step_gen::start_move(dir, steps, config.jog_rate, config.acceleration);
+    jog_pending = 0;
+    jogging = true;
+  }
+}
+
+// E-STOP: the interrupt has stopped the step timers and the gear. Latched
+// here, stopped and disengaged with the positions as counted (a pulse cut
+// short may or may not have been taken). Only the disengage button is
+// served, it releases the stop once the input is closed again.
+bool estop_latched = false;
+
+bool process_estop() {
+  using devices::hmi;
+  if (!config.estop || !devices::estop::tripped) {
+    return false;
+  }
+  if (!estop_latched) {
+    devices::step_gen::inhibit();
+    devices::step_gen2::inhibit();
+    stop_cycle();
+    phase::disengage();
+    jog_pending = 0;
+    control::state = control::State::stopped;
+    estop_latched = true;
+    hmi<>::send_estop();
+  }
+  if (hmi<>::process() == hmi<>::hmi_event::btn_disengage && !devices::estop::is_active()) {
+    devices::step_gen::recover();
+    devices::step_gen2::recover();
+    fine_steps();
+    jog_count = devices::handwheel::count;
+    devices::estop::tripped = false;
+    estop_latched = false;
+  }
+  return true;
+}
+
+void next_jog_multiplier() {
+  jog_multiplier = (jog_multiplier + 1) % config.jog_multipliers.size();
+  devices::hmi<>::send_jog_multiplier(config.jog_multipliers[jog_multiplier]);
+}
+
+template <typename StepGen>
+void move_by(int32_t steps) {
+  StepGen::start_move(steps < 0, (steps < 0) ? -steps : steps,
+          config.max_step_rate, config.acceleration);
+}
+
+// Rotary table: division 0 is where the table was when rotary mode was
+// selected. Only while stopped. Not entered if the hobbing ratio is out of
+// range (see Configuration::rotary), the display tells so.
+int32_t rotary_origin = 0;
+
+void toggle_rotary() {
+  if (!config.rotary && !Configuration::verify_ratio(config.calculate_hobbing_ratio())) {
+    devices::hmi<>::send_hobbing_invalid();
+    return;
+  }
+  config.rotary = !config.rotary;
+  if (config.rotary) {
+    rotary_origin = axes::leadscrew::gear::state.output_position;
+    config.rotary_division = 0;
+  }
+  phase::reference.reset(); // other ratio, other line
+  configure_gear(devices::encoder::get_position());
+  if (config.rotary) {
+    devices::hmi<>::send_division(0, config.rotary_divisions);
+  }
+}
+
+// Moves the table to the next division, positions are exact (rounded to the
+// nearest step) for every division and do not depend on the earlier moves
+void index_rotary() {
+  ++config.rotary_division;
+  move_by<devices::step_gen>(rotary_origin + config.division_position(config.rotary_division) -
+          axes::leadscrew::gear::state.output_position);
+  devices::hmi<>::send_division(config.rotary_division % config.rotary_divisions,
+          config.rotary_divisions);
+}
+
+// Leaves the spindle running, moves back to where the pass started at full
+// speed and engages in phase again (or goes to `then`). Cross slide returns
+// too if it is used, `withdrawn` steps short of its start.
+void return_to_start(control::State then = control::State::engaging, int32_t withdrawn = 0) {
+  using devices::step_gen;
+  using devices::step_gen2;
+  phase::disengage();
+  while (!step_gen::is_idle() || !step_gen2::is_idle()); // last geared pulses
+  fine_steps();
+  move_by<step_gen>(phase::reference->output - phase::engine::state.output_position);
+  if (config.use_taper()) {
+    move_by<step_gen2>(phase::reference->cross_output - withdrawn -
+            phase::cross_engine::state.output_position);
+  }
+  control::after_return = then;
+  control::state = control::State::returning;
+}
+
+void send_cycle_progress() {
+  devices::hmi<>::send_cycle_progress(passes.pass(), passes.passes(),
+          passes.start_no(), passes.starts());
+}
+
+// Starts from standstill. The first pass starts where the carriage is, unless
+// a reference exists (carriage is returned to its start first).
+void start_cycle() {
+  if (control::state != control::State::stopped || cam_mode()) {
+    return;
+  }
+  passes.start(config.cycle_passes, config.thread.starts);
+  if (!passes.active()) {
+    return;
+  }
+  int32_t output = phase::engine::state.output_position;
+  int32_t from = phase::reference ? phase::reference->output : output;
+  cycle::arm_stop(from + config.length_to_steps(config.cycle_length));
+  if (from != output) {
+    return_to_start();
+  }
+  else {
+    control::state = control::State::engaging;
+  }
+  send_cycle_progress();
+}
+
+// Called from the main loop. The step ISR has already stopped the output at
+// the stop position. The tool is withdrawn before the carriage returns
+// through the thread and fed in again (deeper on a new pass) before the next
+// pass engages at the first matching spindle phase. Both by the cross slide
+// with a retract set, else the operator does it and presses the cycle button.
+void process_cycle() {
+  using devices::step_gen2;
+  if (cycle::take_stop()) {
+    phase::disengage();
+    while (!step_gen2::is_idle()); // last geared pulse of a taper
+    if (passes.advance() &&
+        phase::next_start(config.phase_period(), config.thread.starts, false)) {
+      config.next_start();
+    }
+    // Next start at the same depth, a new pass deeper (the taper's line too)
+    const int32_t infeed = (passes.start_no() == 0) ?
+            config.cross_length_to_steps(config.cycle_infeed) : 0;
+    if (config.use_taper()) {
+      phase::reference->cross_output += infeed;
+      cut_cross = phase::reference->cross_output;
+    }
+    else {
+      cut_cross = phase::cross_engine::state.output_position + infeed;
+    }
+    control::state = control::State::retracting;
+    send_cycle_progress();
+  }
+  if (control::state != control::State::retracting && control::state != control::State::infeeding) {
+    return;
+  }
+  const bool retracting = (control::state == control::State::retracting);
+  const int32_t retract = config.cross_length_to_steps(config.cycle_retract);
+  if (!cycle_step_started) {
+    cycle_step_started = true;
+    if (!config.auto_retract()) {
+      devices::hmi<>::send_cycle_wait(retracting);
+    }
+    else if (retracting) {
+      move_by<step_gen2>(-retract);
+    }
+    else {
+      move_by<step_gen2>(cut_cross - phase::cross_engine::state.output_position);
+    }
+    return;
+  }
+  if (config.auto_retract() ? step_gen2::is_moving() : !cycle_confirmed) {
+    return;
+  }
+  cycle_step_started = false;
+  cycle_confirmed = false;
+  if (!retracting) {
+    control::state = control::State::engaging;
+  }
+  else if (passes.active()) {
+    cycle::arm_stop(phase::reference->output + config.length_to_steps(config.cycle_length));
+    return_to_start(control::State::infeeding, config.auto_retract() ? retract : 0);
+  }
+  else {
+    return_to_start(control::State::stopped, config.auto_retract() ? retract : 0);
+  }
+}
+
 int main() {
   using namespace devices;
 
   mcu::init();
+  boot::mark(boot::main_entered);
   
   //Serial2<>::init(); // Used as console
   
+  // Motion first, everything else once the gear is live
+  if (config.estop) {
+    estop::init();
+  }
   step_gen::init();
   step_gen::configure(config.step_dir_hold_ns, config.step_pulse_ns, 
           config.invert_step_pin, config.invert_dir_pin);
+  step_gen::set_backlash(config.backlash_steps, config.backlash_rate);
+  axes::leadscrew::hysteresis = config.reversal_hysteresis;
+  axes::cross_slide::hysteresis = config.reversal_hysteresis;
+  backup::init();
+  restore_snapshot();
+  backup::enable_pvd();
+  if (config.coarse_step() > 1) {
+    microstep_select::init(config.micro_steps_code, config.coarse_micro_steps_code);
+  }
+  step_gen2::init(); // cross slide, idle unless a taper is cut
+  step_gen2::configure(config.step_dir_hold_ns, config.step_pulse_ns, 
+          config.invert_step_pin, config.invert_cross_dir_pin ^ config.taper_outward);
   
-  gear::configure(config.calculate_ratio(), 0);
+  configure_gear(0);
+  axes::leadscrew::enabled = true;
 
-  encoder::init();
-  encoder::update_channels(gear::range.next.count, gear::range.prev.count);
+  encoder::init(config.step_dir_input, config.invert_input_dir_pin);
+  axes::all::update_channels(0);
   
-  encoder_pulse_duration::init();
+  encoder_pulse_duration::init(config.step_dir_input);
+  config.use_index = config.use_index && !config.step_dir_input;
+  if (config.use_index) {
+    encoder_index::init();
+  }
+  boot::mark(boot::gear_live);
+
+  pitch_map_valid = pitch_map.build(config.pitch_origin, config.pitch_segment,
+          config.pitch_corrections);
+  if (config.motor_encoder) {
+    motor_encoder::init(config.invert_motor_encoder);
+  }
+  if (config.handwheel) {
+    handwheel::init(config.invert_handwheel);
+  }
+  if (config.feed && config.feed_override) {
+    feed_override::init();
+  }
   
   using display = hmi<>;
   display::init();
-  display::connect(false); // wait_for_sync : false for PC sim., true for actual display
-  mcu::delay_ms(200);
-  
-  ui::rpm_report = true;
-  
-  display::send_thread_info(config.thread);
+  display::connect(false); // resets the display, see start_display()
+  boot::mark(boot::hmi_reset);
   
   auto f_check_thread = [&](int16_t index) -> uint8_t {
-    return config.verify_thread<encoder::CounterValue>(index);
+    return config.verify_thread(index, phase::gear_scale);
   };
   
   while (true) {
+    start_display();
+    if (process_estop()) {
+      continue;
+    }
+    process_cycle();
+    update_microsteps();
+    verify_position();
+    check_accounting();
+    update_snapshot();
+    process_jog();
+    update_feed_override();
+    if (control::state == control::State::returning) {
+      if (!step_gen::is_moving() && !step_gen2::is_moving()) {
+        control::state = control::after_return;
+      }
+    }
+    if (control::state == control::State::engaging) {
+      axes::leadscrew::pitch_map = (pitch_map.size > 0 && !cam_mode()) ? &pitch_map : nullptr;
+      if (cam_mode() ? phase::try_engage_cam(config.phase_period(), config.use_index) :
+          use_nco() ? phase::try_engage_nco(config.phase_period(), config.use_index) :
+          phase::try_engage(config.phase_period(), config.use_index, config.use_taper())) {
+        control::state = control::State::in_sync;
+      }
+    }
     if (ui::rpm_update && ui::rpm_report) {
       ui::rpm_update = false;
       ui::rpm_cached = rpm_counter<>::get_rpm(config.encoder_resolution);
@@ -166,6 +787,65 @@ int main() {
           change_thread();
           ui::rpm_report = true;
           break;
+        case display::hmi_event::btn_engage:
+          if (control::state == control::State::stopped) {
+            control::state = control::State::engaging;
+          }
+          break;
+        case display::hmi_event::btn_next_start:
+          if (!cam_mode() && phase::next_start(config.phase_period(), config.thread.starts,
+                                control::state == control::State::in_sync)) {
+            config.next_start();
+          }
+          break;
+        case display::hmi_event::btn_return:
+          if (phase::reference && !cam_mode() &&
+              (control::state == control::State::in_sync ||
+               control::state == control::State::stopped)) {
+            stop_cycle();
+            return_to_start();
+          }
+          break;
+        case display::hmi_event::btn_cam:
+          if (control::state == control::State::stopped) {
+            toggle_cam();
+          }
+          break;
+        case display::hmi_event::btn_rotary:
+          if (control::state == control::State::stopped && !cam_mode()) {
+            toggle_rotary();
+          }
+          break;
+        case display::hmi_event::btn_index:
+          if (control::state == control::State::stopped && config.rotary &&
+              step_gen::is_idle()) {
+            index_rotary();
+          }
+          break;
+        case display::hmi_event::btn_jog_multiplier:
+          next_jog_multiplier();
+          break;
+        case display::hmi_event::btn_cycle:
+          if ((control::state == control::State::retracting ||
+               control::state == control::State::infeeding) && !config.auto_retract()) {
+            cycle_confirmed = cycle_step_started; // answers the prompt only
+          }
+          else if (passes.active()) {
+            stop_cycle();
+            phase::disengage();
+            fine_steps();
+            control::state = control::State::stopped;
+          }
+          else {
+            start_cycle();
+          }
+          break;
+        case display::hmi_event::btn_disengage:
+          stop_cycle();
+          phase::disengage();
+          fine_steps();
+          control::state = control::State::stopped;
+          break;
           
         //TODO: handle other events
       }
@@ -6,16 +6,76 @@
 #include <Register/Register.hpp>
 
 namespace mcu {
-  // Work in progress
-  constexpr uint64_t CPU_Clock_Freq_Hz = 72 * std::mega::num;
+  // Clock tree: HSE through the PLL, then the bus prescalers. Register codes
+  // (see SystemInit), timer, USART, ADC and SysTick clocks are derived from
+  // it. The firmware counts every timer in CPU clocks, so the timer clocks
+  // have to be the core clock (an APB divided by two doubles its timers).
+  struct ClockTree {
+    uint32_t hse_hz;
+    uint8_t pll_mul;   // 2 to 16
+    uint16_t ahb_div;  // 1, 2, 4 ... 512 (not 32)
+    uint8_t apb1_div, apb2_div; // 1, 2, 4, 8, 16
+    uint8_t adc_div;   // 2, 4, 6, 8
+
+    constexpr uint32_t sysclk() const { return hse_hz * pll_mul; }
+    constexpr uint32_t hclk() const { return sysclk() / ahb_div; }
+    constexpr uint32_t pclk1() const { return hclk() / apb1_div; }
+    constexpr uint32_t pclk2() const { return hclk() / apb2_div; }
+    constexpr uint32_t timers1() const { return (apb1_div == 1) ? pclk1() : 2 * pclk1(); }
+    constexpr uint32_t timers2() const { return (apb2_div == 1) ? pclk2() : 2 * pclk2(); }
+    constexpr uint32_t adc() const { return pclk2() / adc_div; }
+    constexpr uint32_t systick() const { return hclk() / 8; } // external clock source
+
+    constexpr unsigned pllmul_code() const { return pll_mul - 2; }
+    constexpr unsigned hpre_code() const {
+      return (ahb_div == 1) ? 0 : 0b1000 | (log2(ahb_div) - ((ahb_div > 32) ? 2 : 1));
+    }
+    constexpr unsigned ppre1_code() const { return ppre_code(apb1_div); }
+    constexpr unsigned ppre2_code() const { return ppre_code(apb2_div); }
+    constexpr unsigned adcpre_code() const { return adc_div / 2 - 1; }
+    constexpr unsigned flash_latency() const {
+      return (sysclk() <= 24'000'000) ? 0 : (sysclk() <= 48'000'000) ? 1 : 2;
+    }
+
+  private:
+    static constexpr unsigned log2(unsigned v) { return (v > 1) ? 1 + log2(v / 2) : 0; }
+    static constexpr unsigned ppre_code(uint8_t div) { return (div == 1) ? 0 : 0b100 | (log2(div) - 1); }
+  };
+
+  // 8 MHz crystal. The overclocked profile (128 MHz) is beyond the datasheet
+  // (72 MHz core, 36 MHz APB1), for a finer timer resolution on parts that
+  // take it.
+  constexpr bool overclock = false;
+  constexpr ClockTree clocks = overclock ? ClockTree{8'000'000, 16, 1, 2, 2, 6}
+                                         : ClockTree{8'000'000, 9, 1, 2, 1, 6};
+
+  static_assert(clocks.pll_mul >= 2 && clocks.pll_mul <= 16, "PLL multiplier");
+  static_assert(clocks.ahb_div != 32 && (clocks.ahb_div & (clocks.ahb_div - 1)) == 0, "AHB prescaler");
+  static_assert(clocks.sysclk() <= (overclock ? 128'000'000 : 72'000'000), "core clock");
+  static_assert(clocks.pclk1() <= (overclock ? 64'000'000 : 36'000'000), "APB1 clock");
+  static_assert(clocks.adc() <= 14'000'000, "ADC clock");
+  static_assert(clocks.timers1() == clocks.hclk() && clocks.timers2() == clocks.hclk(),
+                "timers count in CPU clocks");
+
+  constexpr uint64_t CPU_Clock_Freq_Hz = clocks.hclk();
+
+  constexpr uint32_t systick_reload = clocks.systick() / 1000; // 1 ms
+  static_assert(clocks.systick() % 1000 == 0 && systick_reload <= (1u << 24), "SysTick period");
   
   using namespace std::chrono_literals;
   constexpr auto onesec_in_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(1s);
   
   constexpr uint16_t min_timer_capture_count = 5;
   
+  // Rounded, 16x oversampling (mantissa and fraction together)
   constexpr uint16_t usart_brr_val(uint64_t usart_clock_freq, uint32_t baud_rate) {
-    return usart_clock_freq/ baud_rate;
+    return (usart_clock_freq + baud_rate / 2) / baud_rate;
+  }
+
+  // Baud rate error of usart_brr_val in parts per thousand
+  constexpr uint32_t usart_baud_error(uint64_t usart_clock_freq, uint32_t baud_rate) {
+    const uint64_t actual = usart_clock_freq / usart_brr_val(usart_clock_freq, baud_rate);
+    return ((actual > baud_rate) ? (actual - baud_rate) : (baud_rate - actual)) * 1000 / baud_rate;
   }
   
   namespace pins {
@@ -24,12 +84,23 @@ namespace mcu {
     
     using step_pin = Kvasir::gpio::Pin<Kvasir::gpio::PB, 0>;
     using dir_pin = Kvasir::gpio::Pin<Kvasir::gpio::PB, 1>;
+    using step2_pin = Kvasir::gpio::Pin<Kvasir::gpio::PB, 8>; // TIM4 CH3
+    using dir2_pin = Kvasir::gpio::Pin<Kvasir::gpio::PB, 9>;
+    using ms1_pin = Kvasir::gpio::Pin<Kvasir::gpio::PB, 13>; // leadscrew driver microsteps
+    using ms2_pin = Kvasir::gpio::Pin<Kvasir::gpio::PB, 14>;
+    using motor_A = Kvasir::gpio::Pin<Kvasir::gpio::PB, 10>; // EXTI10, motor encoder
+    using motor_B = Kvasir::gpio::Pin<Kvasir::gpio::PB, 11>; // EXTI11
+    using mpg_A = Kvasir::gpio::Pin<Kvasir::gpio::PA, 3>; // EXTI3, handwheel
+    using mpg_B = Kvasir::gpio::Pin<Kvasir::gpio::PA, 4>; // EXTI4
+    using override_pot = Kvasir::gpio::Pin<Kvasir::gpio::PA, 5>; // ADC12_IN5
+    using estop = Kvasir::gpio::Pin<Kvasir::gpio::PA, 0>; // EXTI0
 
     using enc_A = Kvasir::gpio::Pin<Kvasir::gpio::PA, 8>;
     using enc_B = Kvasir::gpio::Pin<Kvasir::gpio::PA, 9>;
     using tim1_ch3 = Kvasir::gpio::Pin<Kvasir::gpio::PA, 10>;
+    using enc_Z = Kvasir::gpio::Pin<Kvasir::gpio::PB, 5>; // EXTI5
 
-    using tim2_ch2 = Kvasir::gpio::Pin<Kvasir::gpio::PA, 1>;
+    using tim2_ch2 = Kvasir::gpio::Pin<Kvasir::gpio::PA, 1>; // enc_A (or STEP) again
     
     using uart2_TX = Kvasir::gpio::Pin<Kvasir::gpio::PA, 2>;
     //using uart2_RX = Kvasir::gpio::Pin<Kvasir::gpio::PA, 3>;
@@ -42,10 +113,17 @@ namespace mcu {
   // if you are getting a compile time error, you might be missing an entry.
   constexpr uint8_t interrupt_priorities(Kvasir::nvic::irq_number_t irq) {
     switch (irq) {
-      case Kvasir::IRQ::tim2_irqn:    return 1;
-      case Kvasir::IRQ::tim1_cc_irqn: return 2;
-      case Kvasir::IRQ::tim3_irqn:    return 4;
-      case Kvasir::IRQ::usart1_irqn:  return 6;
+      case Kvasir::IRQ::exti0_irqn:   return 0; // E-STOP, alone: preempts everything
+      case Kvasir::IRQ::pvd_irqn:     return 1; // supply failing, see devices::backup
+      case Kvasir::IRQ::exti_9_5_irqn: return 2;
+      case Kvasir::IRQ::tim2_irqn:    return 3;
+      case Kvasir::IRQ::tim1_cc_irqn: return 4;
+      case Kvasir::IRQ::exti_15_10_irqn: return 5;
+      case Kvasir::IRQ::tim3_irqn:    return 6;
+      case Kvasir::IRQ::tim4_irqn:    return 6;
+      case Kvasir::IRQ::exti3_irqn:   return 7;
+      case Kvasir::IRQ::exti4_irqn:   return 7;
+      case Kvasir::IRQ::usart1_irqn:  return 8;
       case Kvasir::IRQ::systick_irqn: return 15;
     }
   };
@@ -58,7 +136,27 @@ namespace mcu {
       write(irq::ipr, mcu::interrupt_priorities(irq_n))
     );
   }
+
+  // Masks the interrupt for a short section of a lower priority handler
+  template <Kvasir::nvic::irq_number_t irq_n>
+  inline void disable_interrupt() {
+    using irq = Kvasir::nvic::irq<irq_n>;
+    apply(write(irq::clrena, true));
+  }
   
+  // DWT cycle counter: CPU clocks, free running over 32 bits (about a minute).
+  // Time base of the NCO (see nco.hpp), readable from any interrupt.
+  namespace cycle_counter {
+    using namespace Kvasir::Register;
+    constexpr FieldLocation<Address<0xE000EDFC>, maskFromRange(24, 24), ReadWriteAccess> trcena{}; // DEMCR
+    constexpr FieldLocation<Address<0xE0001000>, maskFromRange(0, 0), ReadWriteAccess> enable{}; // DWT_CTRL
+    constexpr FieldLocation<Address<0xE0001004>, maskFromRange(31, 0), ReadWriteAccess, unsigned> count{}; // DWT_CYCCNT
+  }
+
+  inline uint32_t cycles() {
+    return apply(read(cycle_counter::count));
+  }
+
   static void toggle_led() {
     bool led = apply(read(pins::led_pin::odr)); 
     apply(write(pins::led_pin::odr, !led));
@@ -70,11 +168,24 @@ namespace mcu {
 
     apply(write(pins::debug_pin::cr::mode, gpio::PinMode::Output_2Mhz),
           write(pins::debug_pin::cr::cnf, gpio::PinConfig::Output_push_pull));
-    
+
+    apply(set(cycle_counter::trcena)); // trace block on, then the counter
+    apply(set(cycle_counter::enable));
+
   }
   
   inline volatile unsigned int milliseconds = 0;
 
+  // Time since the clock setup, from the SysTick count (1 ms period)
+  inline unsigned int microseconds() {
+    unsigned int ms, ticks;
+    do {
+      ms = milliseconds;
+      ticks = apply(read(Kvasir::Stk_Val::Current));
+    } while (ms != milliseconds);
+    return ms * 1000 + (systick_reload - 1 - ticks) / (clocks.systick() / 1'000'000);
+  }
+
   inline void delay_ms(unsigned int ms) {
     const auto target_tick = milliseconds + ms;
     while (milliseconds != target_tick);
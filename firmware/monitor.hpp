@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+#include "devices.hpp"
+
+// Step accounting monitor. Engaged, the gear follows an exact line:
+//   N * input - D * (output - correction) - line = error
+// with the error within half a step (plus the slope of a count not yet seen
+// by the gear). `line` is known from the first jump, so a consistent snapshot
+// of the spindle count and the gear position shows a missed compare (the gear
+// stays behind the line) without relying on the gear's own error term. When
+// the step timer is idle, the output position counted by the step interrupt
+// has to be the gear position: a lost pulse interrupt shows there. Not
+// checked while the gear catches up (its own error beyond half a step, after
+// a microstep switch or lost steps were handed to it).
+//
+// Runs in the main loop, outside of any interrupt. A discrepancy is counted
+// once, the monitor restarts on the next engagement.
+namespace monitor {
+
+  template <typename Axis>
+  struct Accounting {
+    uint16_t errors = 0;
+    bool failed = false;
+
+    struct Snapshot {
+      int32_t input;
+      int32_t position;   // gear position
+      int32_t output;     // output position
+      int32_t correction; // pitch correction
+    };
+
+    // `valid`: engaged on the gear line, without cam or NCO. Returns true when
+    // a new discrepancy is found.
+    bool check(bool valid) {
+      using gear = typename Axis::gear;
+      if (!valid || failed || gear::profile.index < gear::profile.size) {
+        failed = failed && valid;
+        return false;
+      }
+      const int64_t d = int64_t(gear::state.D) * gear::state.step, n = gear::state.N;
+      const int err = gear::state.err;
+      if (2 * int64_t((err < 0) ? -err : err) > d) {
+        return false;
+      }
+      const Snapshot s = snapshot();
+      const int64_t error = n * s.input - int64_t(gear::state.D) * (s.position - s.correction) -
+              Axis::line;
+      const int64_t margin = d / 2 + (2 + Axis::hysteresis) * n; // latency, late reversal
+      bool ok = (error >= -margin) && (error <= margin + n);
+      if (Axis::step_gen::is_idle() && Axis::lost_taken == Axis::lost_counted) {
+        ok = ok && (s.output == s.position);
+      }
+      if (!ok) {
+        ++errors;
+        failed = true;
+      }
+      return !ok;
+    }
+
+  private:
+    static Snapshot snapshot() {
+      using devices::encoder;
+      Snapshot s;
+      do {
+        s.input = encoder::get_position();
+        std::atomic_signal_fence(std::memory_order_acquire);
+        s.position = Axis::position;
+        s.output = Axis::gear::state.output_position;
+        s.correction = Axis::correction;
+        std::atomic_signal_fence(std::memory_order_acquire);
+      } while (s.input != encoder::get_position() || s.position != Axis::position);
+      return s;
+    }
+  };
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+
+// Numerically controlled oscillator following the spindle, an alternative to
+// the compare triggered gear for extreme ratios. The gear steps at the count
+// after the line crossed half a step, delayed by the count period times the
+// rest of the step: a delay over many counts extrapolates one noisy period
+// and is cut at the range of the step timer. Here the step timer runs free
+// and every step is scheduled at the time the line reaches it.
+//
+// Input is observed at count edges: the encoder compare interrupts every few
+// counts (at least observe_ticks apart) and the CPU cycle counter time-stamps
+// the count. The count period is the time over the last `history`
+// observations, every count in between is in it. A step is due at the last
+// observed count plus the counts to the step's line crossing at that period,
+// so the phase is taken from the latest edge and never filtered.
+//
+// Timer preload delays a new period by one: the period (and whether it ends
+// with a pulse) is set for the one after the running period, its start is
+// known exactly from the periods set before. A step further away than
+// `approach` is reached by periods without pulse of at most that length, so
+// a step is decided at most two such periods ahead, on fresh observations.
+// A step found late is made right away. No observation for two of their
+// intervals (spindle stopped or reversed), no steps until the next.
+//
+// Cost is an interrupt per observation and per period, a few 64 bit
+// divisions each.
+namespace nco {
+
+  struct Next {
+    uint16_t period; // timer ticks
+    bool pulse;      // period ends with a step
+  };
+
+  struct Loop {
+    static constexpr unsigned Frac = 8;            // fraction bits of the count period
+    static constexpr unsigned history = 32;        // observations the count period is taken over
+    static constexpr uint32_t observe_ticks = 64;  // shortest time between observations
+    static constexpr int32_t max_observe_counts = 64;
+    static constexpr uint16_t approach = 250;      // longest period before a step
+    static constexpr uint16_t min_period = 16;
+    static constexpr uint16_t poll_period = 500;   // no input observed
+
+    // Line: error = N * (input - input0) - D * (output - output0) - error0,
+    // a step is due where the error of the output after it is zero (like the
+    // gear with its phase delay). `at` is the CPU cycle count when the timer
+    // starts its first period (poll_period).
+    void start(int d, int n, int32_t input0, int32_t output0, int error0,
+               uint32_t tick_div, uint32_t at) {
+      d_ = d;
+      n_ = n;
+      input0_ = input0;
+      output0_ = output0;
+      error0_ = error0;
+      tick_div_ = tick_div;
+      seen_ = 0;
+      end_ = at;
+      running_ = next_ = {poll_period, false};
+    }
+
+    // Called from the encoder compare interrupt: `input` was reached at CPU
+    // cycle `at`. Returns the count to observe next.
+    int32_t observe(int32_t input, uint32_t at) {
+      const unsigned seen = seen_;
+      inputs_[seen % history] = input;
+      times_[seen % history] = at;
+      int32_t step = 1;
+      if (seen > 0) {
+        const unsigned oldest = (seen >= history) ? (seen + 1) % history : 0;
+        const uint32_t counts = input - inputs_[oldest];
+        const uint32_t cycles = at - times_[oldest];
+        const uint64_t period = (uint64_t(cycles) << Frac) / std::max<uint32_t>(counts, 1);
+        count_period_ = static_cast<uint32_t>(std::min<uint64_t>(period, max_count_period));
+        step = static_cast<int32_t>(std::clamp<uint64_t>(
+                (uint64_t(observe_ticks * tick_div_) << Frac) / count_period_ + 1, 1, max_observe_counts));
+        gap_ = static_cast<uint32_t>((uint64_t(count_period_) * step) >> Frac);
+      }
+      last_input_ = input;
+      last_at_ = at;
+      std::atomic_signal_fence(std::memory_order_release);
+      seen_ = seen + 1;
+      return input + step;
+    }
+
+    // Called from the step interrupt at the end of every period, `output` is
+    // the output position after it. Returns the period after the running one.
+    Next update(int32_t output) {
+      end_ += running_.period * tick_div_; // now
+      running_ = next_;
+      const uint32_t start = end_ + running_.period * tick_div_; // of the period set here
+      unsigned seen;
+      int32_t input;
+      uint32_t at, period, gap;
+      do { // an observation in between is taken whole
+        seen = seen_;
+        std::atomic_signal_fence(std::memory_order_acquire);
+        input = last_input_;
+        at = last_at_;
+        period = count_period_;
+        gap = gap_;
+        std::atomic_signal_fence(std::memory_order_acquire);
+      } while (seen != seen_);
+
+      if (seen < 2 || int32_t(end_ - at) > int32_t(2 * gap)) {
+        next_ = {poll_period, false};
+        return next_;
+      }
+      // Next step (after the one the running period may end with), the error
+      // it is short of at the observed count in counts times N
+      const int32_t step = output + (running_.pulse ? 1 : 0) + 1;
+      const int64_t ahead = int64_t(d_) * (step - output0_) + error0_ - int64_t(n_) * (input - input0_);
+      const int64_t due = int64_t(int32_t(at - start)) +
+              ahead * period / (int64_t(n_) << Frac); // CPU cycles after the start
+      const int64_t left = (due + tick_div_ / 2) / int64_t(tick_div_);
+      if (left < min_period) { // late, step right away
+        next_ = {min_period, true};
+      }
+      else if (left <= approach) {
+        next_ = {static_cast<uint16_t>(left), true};
+      }
+      else {
+        next_ = {static_cast<uint16_t>(std::min<int64_t>(left / 2, approach)), false};
+      }
+      return next_;
+    }
+
+  private:
+    static constexpr uint32_t max_count_period = 0x7FFFFFFF;
+
+    int d_{1}, n_{0};
+    int32_t input0_{0}, output0_{0};
+    int error0_{0};
+    uint32_t tick_div_{1};
+    uint32_t end_{0};   // CPU cycle the running period started at
+    Next running_{}, next_{};
+
+    // Written by observe(), which preempts update()
+    int32_t inputs_[history]{};
+    uint32_t times_[history]{};
+    volatile unsigned seen_{0};
+    volatile int32_t last_input_{0};
+    volatile uint32_t last_at_{0};
+    volatile uint32_t count_period_{0}; // CPU cycles per count, Q8
+    volatile uint32_t gap_{0};          // CPU cycles to the next observation
+  };
+
+}
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <numeric>
+#include <algorithm>
+#include <atomic>
+
+#include "gear.hpp"
+#include "devices.hpp"
+#include "axes.hpp"
+#include "nco.hpp"
+
+// Re-engaging the gear in phase with an earlier pass, so that every threading
+// pass follows the same groove.
+//
+// The gear keeps the invariant: err = N * input - D * output + constant
+// The first pass defines the constant (the *line*). The spindle angle repeats
+// every `period` encoder counts, so any line shifted by a multiple of `period`
+// counts cuts the same groove. For an output waiting at some position, we
+// find the first count on one of those lines where the output should step
+// forward and place the forward compare there. No steps are made before.
+namespace phase {
+
+  using axis = axes::leadscrew; // threading is done by the leadscrew
+  using engine = axis::gear;
+  using cross_axis = axes::cross_slide; // tapers: follows the same input line
+  using cross_engine = cross_axis::gear;
+
+  struct Reference {
+    int32_t input;  // encoder position where error is zero (relative to origin)
+    int32_t output; // output position at that encoder position
+    int error{0};   // line moved back by error/N counts (i.e. a fraction of a count)
+    int32_t cross_output{0}; // cross slide position at that encoder position
+    int32_t correction{0};   // pitch correction at `output` (see pitch.hpp)
+  };
+
+  struct Engagement {
+    int32_t count; // extended encoder position of the first step
+    int error;     // error after the first step
+  };
+
+  namespace detail {
+    constexpr int64_t div_ceil(int64_t a, int64_t b) { // b > 0
+      return (a >= 0) ? (a + b - 1) / b : -((-a) / b);
+    }
+  }
+
+  // Same result as gear::next_jump_forward, starting from the reference line
+  constexpr Engagement line_step(int d, int n, const Reference& ref, int32_t output) {
+    int64_t x = int64_t(d) * (output - ref.output) + ref.error;
+    // smallest t satisfying 2 * (n * t - x) >= d
+    int64_t t = detail::div_ceil(d + 2 * x, 2 * int64_t(n));
+    return {ref.input + static_cast<int32_t>(t), static_cast<int>(n * t - x - d)};
+  }
+
+  // Whole periods to move `count` ahead so it is not earlier than `earliest`
+  constexpr int32_t periods_until(int32_t count, int32_t earliest, int32_t period) {
+    return static_cast<int32_t>(detail::div_ceil(int64_t(earliest) - count, period));
+  }
+
+  // First step on the reference line (or one shifted by whole periods)
+  constexpr Engagement first_step(int d, int n, const Reference& ref,
+                                  int32_t period, int32_t output, int32_t earliest) {
+    auto e = line_step(d, n, ref, output);
+    e.count += periods_until(e.count, earliest, period) * period;
+    return e;
+  }
+
+  // Multi-start threads: next start is 1/starts of a revolution later. Exact
+  // shift is N * period / starts in error units, which is kept integral by
+  // scaling the gear terms. Scale also makes N divisible by the number of
+  // catch-up slope levels (see catch_up).
+  constexpr int catch_up_levels = 4; // down to half speed
+
+  inline int gear_scale(int starts, int n, int32_t period) {
+    if (starts <= 1) {
+      return 1;
+    }
+    constexpr int slope_div = 2 * catch_up_levels;
+    return std::lcm(slope_div / std::gcd(slope_div, n),
+                    starts / std::gcd(starts, int((int64_t(n) * period) % starts)));
+  }
+
+  struct Shift {
+    int32_t counts;
+    int error; // [0, N)
+  };
+
+  inline Shift start_shift(int n, int32_t period, int starts) {
+    int64_t total = int64_t(n) * period / starts;
+    int32_t counts = total / n;
+    return {counts, static_cast<int>(total - int64_t(counts) * n)};
+  }
+
+  inline void shift(Reference& ref, int n, const Shift& s) {
+    ref.input += s.counts;
+    ref.error += s.error;
+    if (ref.error >= n) {
+      ref.error -= n;
+      ++ref.input;
+    }
+  }
+
+  // Minimum distance (in encoder counts) between the current position and the
+  // first step, giving the main loop time to arm the compare.
+  constexpr int32_t arm_margin = 16;
+
+  inline std::optional<Reference> reference{};
+
+  // NCO mode: the loop runs the leadscrew's step timer on the reference line
+  inline nco::Loop follower{};
+
+  inline void disengage() {
+    using devices::encoder;
+    encoder::disable_cc_interrupt();
+    encoder::trigger_clear();
+    axis::step_gen::stop_run();
+    engine::clear_profile(); // an unfinished catch-up is dropped, reference has already moved
+  }
+
+  namespace detail {
+    template <typename Axis>
+    void prepare(const gear::Jump& next) {
+      using step_gen = typename Axis::step_gen;
+      auto& range = Axis::gear::range;
+      while (step_gen::is_compensating()); // burst of the last reversal
+      step_gen::take_up_slack(false); // left in reverse by a return or a jog
+      while (step_gen::is_compensating());
+      if (step_gen::get_direction()) {
+        step_gen::change_direction(false);
+      }
+      range.next = next;
+      // No reverse jump before the first step (half of the position range away)
+      range.prev = next;
+      range.prev.count += 0x80000000u;
+      Axis::position = Axis::gear::state.output_position;
+      Axis::line = int64_t(Axis::gear::state.N) * static_cast<int32_t>(next.count) -
+              int64_t(Axis::gear::state.D) * (Axis::position + 1 - Axis::correction) - next.error;
+      Axis::enabled = true;
+    }
+
+    template <typename Axis>
+    gear::Jump first_jump(const Engagement& e) {
+      return {static_cast<gear::Count>(e.count), 0, e.error, Axis::gear::state.N, 0};
+    }
+  }
+
+  // Arms the forward compare for the first step (of each engaged axis). CC
+  // interrupt is kept disabled until the compares are known to be ahead of
+  // the counter, so the ISR never sees a partially written range. Returns
+  // false if a count was missed.
+  inline bool arm(const gear::Jump& e, const std::optional<gear::Jump>& cross = {}) {
+    using devices::encoder;
+    detail::prepare<axis>(e);
+    cross_axis::enabled = false;
+    if (cross) {
+      detail::prepare<cross_axis>(*cross);
+    }
+    encoder::clear_cc_interrupt();
+    axes::all::update_channels(encoder::get_position());
+    encoder::trigger_restore();
+    gear::Count now = encoder::get_position();
+    auto distance = gear::distance(now, e.count);
+    if (cross) {
+      distance = std::min(distance, gear::distance(now, cross->count));
+    }
+    if (distance <= 0 && !encoder::is_cc_fwd_interrupt()) {
+      encoder::trigger_clear();
+      return false;
+    }
+    encoder::enable_cc_interrupt();
+    return true;
+  }
+
+  // Engages the gear on the reference line. The first call defines the
+  // reference. With an index, positions are taken relative to the last index
+  // pulse (immune to lost counts), otherwise to the extended encoder position.
+  // Runs in the main loop, only the armed compare is handed over to the ISR.
+  // With `cross`, the cross slide is engaged on its own line through the same
+  // reference, shifted by the same whole periods (the taper stays on one line).
+  namespace detail {
+    // Reference in extended encoder positions (defined on the first call)
+    inline std::optional<Reference> line_at(int32_t period, bool use_index, int32_t earliest) {
+      using devices::encoder_index;
+      int32_t origin = 0;
+      if (use_index) {
+        auto [index_position, index_count] = encoder_index::last_pulse();
+        if (index_count == 0) {
+          return {};
+        }
+        origin = index_position;
+      }
+      axis::load_correction(engine::state.output_position);
+      if (!reference) {
+        reference = Reference{earliest - origin, engine::state.output_position, 0,
+                              cross_engine::state.output_position, axis::correction};
+      }
+      else { // keep it close, whole periods do not change the groove
+        reference->input += ((earliest - origin - reference->input) / period) * period;
+      }
+      return Reference{origin + reference->input, reference->output, reference->error};
+    }
+  }
+
+  // Away from the reference position, the output is taken without the pitch
+  // corrections in between (the line is on the nominal lead).
+  inline bool try_engage(int32_t period, bool use_index, bool cross = false) {
+    using devices::encoder;
+    int32_t cross_output = cross_engine::state.output_position;
+    int32_t earliest = encoder::get_position() + arm_margin;
+    auto line = detail::line_at(period, use_index, earliest);
+    if (!line) {
+      return false;
+    }
+    const Reference& ref = *line;
+    int32_t output = engine::state.output_position - (axis::correction - reference->correction);
+    if (!cross) {
+      return arm(detail::first_jump<axis>(
+              first_step(engine::state.D, engine::state.N, ref, period, output, earliest)));
+    }
+    auto e = line_step(engine::state.D, engine::state.N, ref, output);
+    // Fraction of a count the line is moved back by, in the cross slide's units
+    const int n = cross_engine::state.N;
+    Reference cross_ref{ref.input, reference->cross_output, static_cast<int>(
+            (int64_t(ref.error) * n + engine::state.N / 2) / engine::state.N)};
+    auto c = line_step(cross_engine::state.D, n, cross_ref, cross_output);
+    int32_t shift = std::max(periods_until(e.count, earliest, period),
+                             periods_until(c.count, earliest, period)) * period;
+    e.count += shift;
+    c.count += shift;
+    return arm(detail::first_jump<axis>(e), detail::first_jump<cross_axis>(c));
+  }
+
+  // NCO mode: the step timer runs on the same reference line as the gear
+  // would, forward only, from the same first step. Leadscrew only. The
+  // forward compare observes the input for the loop (see observe()), it does
+  // not trigger.
+  inline bool try_engage_nco(int32_t period, bool use_index) {
+    using devices::encoder;
+    using step_gen = axis::step_gen;
+    int32_t earliest = encoder::get_position() + arm_margin;
+    auto line = detail::line_at(period, use_index, earliest);
+    if (!line) {
+      return false;
+    }
+    axis::enabled = false;
+    cross_axis::enabled = false;
+    const int32_t output = engine::state.output_position;
+    auto e = first_step(engine::state.D, engine::state.N, *line, period, output, earliest);
+    encoder::trigger_clear();
+    encoder::clear_cc_interrupt();
+    step_gen::take_up_slack(false);
+    while (step_gen::is_compensating());
+    follower.start(engine::state.D, engine::state.N, e.count, output + 1, -e.error,
+                   step_gen::TimedClockDiv, mcu::cycles());
+    step_gen::start_run(nco::Loop::poll_period);
+    gear::Count next = encoder::get_position() + 1;
+    encoder::update_channels(static_cast<encoder::CounterValue>(next),
+                             static_cast<encoder::CounterValue>(next));
+    encoder::enable_cc_interrupt();
+    return true;
+  }
+
+  // NCO mode, from the CC interrupt: the count reached, timed, and the next
+  // one to observe
+  inline void observe() {
+    using devices::encoder;
+    const uint32_t at = mcu::cycles();
+    const gear::Count count = encoder::extend(encoder::get_fwd_compare());
+    encoder::clear_cc_interrupt();
+    int32_t next = follower.observe(static_cast<int32_t>(count), at);
+    const int32_t now = encoder::get_position();
+    if (next - now < 1) { // passed already (held up by a higher priority)
+      next = now + 1;
+    }
+    encoder::update_channels(static_cast<encoder::CounterValue>(next),
+                             static_cast<encoder::CounterValue>(next));
+  }
+
+  // Cam mode: the cam period starts at a spindle revolution (an index pulse
+  // if there is one), output is taken as being at the start of the cam there.
+  inline bool try_engage_cam(int32_t revolution, bool use_index) {
+    using devices::encoder;
+    using devices::encoder_index;
+    int32_t earliest = encoder::get_position() + arm_margin;
+    int32_t origin = earliest;
+    if (use_index) {
+      auto [index_position, index_count] = encoder_index::last_pulse();
+      if (index_count == 0) {
+        return false;
+      }
+      origin = index_position + periods_until(index_position, earliest, revolution) * revolution;
+    }
+    axis::load_correction(engine::state.output_position); // no pitch map with a cam
+    engine::start_cam(static_cast<gear::Count>(origin));
+    return arm(engine::range.next);
+  }
+
+  // Makes the engaged output lag by `s` without losing sync: slope steps down
+  // by N / (2 * levels) until half speed, holds, and steps back up. The exact
+  // remainder (less than a count) is taken at the last boundary.
+  inline bool catch_up(const Shift& s) {
+    using devices::encoder;
+    using step_gen = axis::step_gen;
+    auto& profile = engine::profile;
+    auto& range = engine::range;
+    constexpr int h = catch_up_levels;
+    const int n = engine::state.N;
+    const int u = n / (2 * h);
+    const int64_t total = int64_t(s.counts) * n + s.error;
+    const int32_t window = (2 * total) / n; // counts at half speed
+    const int32_t ramp = window / (2 * (h - 1));
+    const int32_t hold = window - ramp * (h - 1);
+    if (ramp == 0) {
+      return false;
+    }
+    std::array<gear::Boundary, 2 * h> b{};
+    gear::Count at = 0;
+    int slope = n;
+    auto add = [&, i = 0u](int new_slope, int32_t length, int adjust = 0) mutable {
+      b[i++] = {at, slope, new_slope, adjust};
+      slope = new_slope;
+      at += length;
+    };
+    for (int j = 1; j < h; ++j) {
+      add(n - u * j, ramp);
+    }
+    add(n - u * h, hold);
+    for (int j = h - 1; j > 0; --j) {
+      add(n - u * j, ramp);
+    }
+    add(n, 0, static_cast<int>(total - int64_t(window) * n / 2));
+
+    encoder::disable_cc_interrupt();
+    const uint8_t size = profile.size;
+    bool idle = !step_gen::get_direction() && (profile.index == size) &&
+                (range.next.index == size) && (range.prev.index == size);
+    if (idle) {
+      axis::line += total; // the gear ends up on the moved line
+      gear::Count start = encoder::get_position() + arm_margin;
+      if (gear::distance(start, range.next.count) > 0) {
+        start = range.next.count; // boundary must not be skipped by the armed jump
+      }
+      profile.size = 0;
+      profile.index = 0;
+      range.next.index = 0;
+      range.prev.index = 0;
+      for (unsigned i = 0; i < b.size(); ++i) {
+        profile.boundaries[i] = b[i];
+        profile.boundaries[i].count += start;
+      }
+      std::atomic_signal_fence(std::memory_order_release);
+      profile.size = b.size();
+    }
+    encoder::enable_cc_interrupt();
+    return idle;
+  }
+
+  // Selects the next start. Reference is moved so the following passes are
+  // engaged on it. If engaged, the output catches up while the spindle turns
+  // (leadscrew only, not while cutting a taper).
+  inline bool next_start(int32_t period, int starts, bool engaged) {
+    if (starts <= 1 || (engaged && cross_axis::enabled)) {
+      return false;
+    }
+    auto s = start_shift(engine::state.N, period, starts);
+    if (engaged && !catch_up(s)) {
+      return false;
+    }
+    if (reference) {
+      shift(*reference, engine::state.N, s);
+    }
+    return true;
+  }
+
+}
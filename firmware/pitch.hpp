@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+
+// Leadscrew pitch error compensation. The measured error is given per segment
+// of the output range: `corrections[i]` steps to add (withhold if negative)
+// over the i-th segment of `segment` output steps from `origin`. They are
+// spread evenly over the segment as single step points. Reaching a point
+// moves the line of the gear by one step, so the extra (or withheld) step is
+// made by the gear itself (see axes::Axis). The table is built and searched
+// outside of the step path, the gear only compares against the points next
+// to the output and walks the sorted points when one is crossed.
+namespace pitch {
+
+  struct Point {
+    int32_t at; // output position
+    int sign;   // +1: extra step, -1: step withheld
+  };
+
+  struct Map {
+    static constexpr uint8_t capacity = 64;
+    static constexpr Point none_above{std::numeric_limits<int32_t>::max(), 0};
+    static constexpr Point none_below{std::numeric_limits<int32_t>::min(), 0};
+
+    std::array<Point, capacity> points{};
+    uint8_t size = 0; // no compensation if zero
+
+    // Returns false (and leaves an empty map) if there are more corrections
+    // than points, or than steps in a segment
+    template <std::size_t Segments>
+    bool build(int32_t origin, uint32_t segment, const std::array<int8_t, Segments>& corrections) {
+      size = 0;
+      uint8_t count = 0;
+      for (std::size_t i = 0; i < Segments; ++i) {
+        const int c = corrections[i];
+        const uint32_t steps = std::abs(c);
+        if (steps > segment || count + steps > capacity) {
+          return false;
+        }
+        const int32_t start = origin + static_cast<int32_t>(i * segment);
+        for (uint32_t k = 0; k < steps; ++k) {
+          int32_t at = start + static_cast<int32_t>(((2 * k + 1) * uint64_t(segment)) / (2 * steps));
+          points[count++] = {at, (c > 0) ? 1 : -1};
+        }
+      }
+      size = count;
+      return true;
+    }
+
+    // Index of the first point above `position`
+    uint8_t index_above(int32_t position) const {
+      auto it = std::upper_bound(points.begin(), points.begin() + size, position,
+                                 [](int32_t p, const Point& q) { return p < q.at; });
+      return static_cast<uint8_t>(it - points.begin());
+    }
+
+    Point at(int i) const {
+      return (i < 0) ? none_below : (i >= size) ? none_above : points[i];
+    }
+
+    // Sum of the corrections at or below `position`
+    int32_t offset(int32_t position) const {
+      int32_t sum = 0;
+      for (uint8_t i = 0, end = index_above(position); i < end; ++i) {
+        sum += points[i].sign;
+      }
+      return sum;
+    }
+  };
+
+}
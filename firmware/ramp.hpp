@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+
+// Step timing for moves that are not geared to the input (e.g. rapid return).
+// Constant acceleration using the incremental approximation from D. Austin,
+// "Generate stepper-motor speed profiles in real time" (2005):
+//   c(n) = c(n - 1) - 2 * c(n - 1) / (4 * n + 1)
+// Integer only, one division per step, so it can run in the step interrupt.
+namespace ramp {
+
+  constexpr uint32_t isqrt(uint64_t v) {
+    uint64_t r = 0, bit = uint64_t(1) << 62;
+    while (bit > v) bit >>= 2;
+    while (bit != 0) {
+      if (v >= r + bit) {
+        v -= r + bit;
+        r = (r >> 1) + bit;
+      } else {
+        r >>= 1;
+      }
+      bit >>= 2;
+    }
+    return static_cast<uint32_t>(r);
+  }
+
+  struct Generator {
+    static constexpr unsigned Frac = 8; // fixed point fraction bits of the period
+    static constexpr uint32_t max_period = (uint32_t(0xFFFF) << Frac);
+
+    // Prepares a move of `steps` steps. Periods are in timer ticks.
+    void start(uint32_t steps, uint32_t tick_freq, uint32_t max_speed, uint32_t acceleration) {
+      // first period, scaled by 0.676 to correct the error of the approximation
+      uint64_t c0 = uint64_t(isqrt(2 * uint64_t(tick_freq) * tick_freq / acceleration)) * 676 / 1000;
+      // a top speed slower than the timer reaches runs at its longest period
+      c_min = static_cast<uint32_t>(std::min<uint64_t>(uint64_t(tick_freq / max_speed) << Frac, max_period));
+      c = std::clamp(static_cast<uint32_t>(std::min<uint64_t>(c0 << Frac, max_period)), c_min, max_period);
+      n = 0;
+      left = steps;
+    }
+
+    bool done() const {
+      return left == 0;
+    }
+
+    // The end of a running move: further away (accelerating again if
+    // needed), or closer down to the start of the deceleration. Return the
+    // steps taken.
+    uint32_t extend(uint32_t steps) {
+      left += steps;
+      return steps;
+    }
+
+    uint32_t shorten(uint32_t steps) {
+      const uint32_t s = std::min(steps, (left > n) ? (left - n) : 0u);
+      left -= s;
+      return s;
+    }
+
+    // Period of the next step
+    uint16_t next() {
+      auto period = static_cast<uint16_t>(c >> Frac);
+      --left;
+      if (left <= n) { // decelerate, mirror of the acceleration
+        if (n > 0) {
+          c = std::min(c + (2 * c) / (4 * n - 1), max_period);
+          --n;
+        }
+      }
+      else if (c > c_min) {
+        ++n;
+        c = std::max(c - (2 * c) / (4 * n + 1), c_min);
+      }
+      return period;
+    }
+
+  private:
+    uint32_t c{max_period}, c_min{max_period};
+    uint32_t n{0};    // number of acceleration steps
+    uint32_t left{0}; // steps left to schedule
+  };
+
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+
+// Host stand-in for devices.hpp, enough of TIM1 and the step timers to run
+// axes.hpp unchanged. The encoder moves one count at a time (sim::turn()),
+// compares match like the hardware does and the CC interrupt is served right
+// away. A step timer armed by the forward compare (TRGO) or the manual
+// trigger makes one pulse, counted as the output position.
+namespace sim {
+
+  inline uint64_t now = 0;        // CPU ticks
+  inline int32_t position = 0;    // extended encoder position
+  inline uint16_t ccr3 = 0, ccr4 = 0;
+  inline bool cc3_flag = false, cc4_flag = false;
+  inline bool trgo_enabled = true; // TRGO from CC3, cleared by the ISR
+  inline unsigned interrupts = 0;
+  inline uint16_t input_period = 100; // encoder count period, CPU ticks
+
+  void trgo();
+  void serve();
+
+  // One encoder count forward (+1) or back (-1)
+  inline void turn(int direction) {
+    now += input_period;
+    position += direction;
+    const uint16_t count = static_cast<uint16_t>(position);
+    if (count == ccr3) {
+      if (trgo_enabled) {
+        trgo();
+      }
+      cc3_flag = true;
+    }
+    if (count == ccr4) {
+      cc4_flag = true;
+    }
+    serve();
+  }
+}
+
+namespace devices {
+
+  // Ideal timer unless `busy` is set: then a trigger is taken `delay` (the
+  // phase delay, CPU ticks) plus `busy` after the last one at the earliest,
+  // an earlier one is lost like on the one-pulse timer.
+  template <int Index>
+  struct step_generator {
+    inline static bool direction = false, triggered = false;
+    inline static int32_t position = 0; // output steps made
+    inline static int32_t pulses = 0, lost = 0;
+    inline static unsigned delay = 0, busy = 0;
+    inline static uint64_t ready_at = 0;
+    static constexpr unsigned max_delay = 0xFFFF * 2;
+
+    static bool get_direction() { return direction; }
+    static void change_direction(bool dir) { direction = dir; }
+    static void set_triggered(bool on) { triggered = on; }
+    static void set_delay(unsigned delay_count) { delay = delay_count; }
+    static void compensate() {}
+    static bool is_compensating() { return false; }
+    static void queue_step(bool) {}
+
+    static void trigger() {
+      if (!triggered) {
+        return;
+      }
+      if (sim::now < ready_at) {
+        ++lost;
+        return;
+      }
+      if (busy != 0) {
+        ready_at = sim::now + delay + busy;
+      }
+      position += direction ? -1 : 1;
+      ++pulses;
+    }
+  };
+
+  using step_gen = step_generator<0>;
+  using step_gen2 = step_generator<1>;
+
+  struct encoder_pulse_duration {
+    static uint16_t last_duration() { return sim::input_period; }
+  };
+
+  struct encoder {
+    using CounterValue = uint16_t;
+
+    static bool is_cc_fwd_interrupt() { return sim::cc3_flag; }
+    static CounterValue get_fwd_compare() { return sim::ccr3; }
+    static CounterValue get_rev_compare() { return sim::ccr4; }
+    static void clear_cc_interrupt() { sim::cc3_flag = sim::cc4_flag = false; }
+    static void trigger_clear() { sim::trgo_enabled = false; }
+    static void trigger_restore() { sim::trgo_enabled = true; }
+    static void trigger_manual_pulse() { sim::trgo(); }
+
+    static void update_channels(CounterValue fwd, CounterValue rev) {
+      sim::ccr3 = fwd;
+      sim::ccr4 = rev;
+    }
+
+    static CounterValue get_count() { return static_cast<CounterValue>(sim::position); }
+    static int32_t get_position() { return sim::position; }
+
+    static int32_t extend(CounterValue value) {
+      return sim::position + static_cast<int16_t>(value - static_cast<CounterValue>(sim::position));
+    }
+  };
+
+}
+
+namespace sim {
+  inline void trgo() {
+    devices::step_gen::trigger();
+    devices::step_gen2::trigger();
+  }
+}
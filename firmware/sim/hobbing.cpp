@@ -0,0 +1,75 @@
+// Hobbing: the rotary table geared to the hob spindle over thousands of
+// revolutions, for the tooth counts and starts the default setup (1600
+// steps, 90:1 worm, 2400 counts) takes. The table has to stay within half a
+// step of its exact line at every count and be back on it, without error,
+// after every whole number of table turns. Indexing positions are checked
+// over the same turns.
+
+#include "sim.hpp"
+#include "configuration.hpp"
+
+int main() {
+  using namespace axes;
+  Configuration config;
+  const int32_t counts_per_rev = config.phase_period();
+  const uint32_t table_turns = 16;
+
+  // The default setup has to be one the display takes
+  int failed = Configuration::verify_ratio(config.calculate_hobbing_ratio()) ? 0 : 1;
+  int tested = 0;
+  uint64_t revolutions = 0;
+  for (uint8_t starts = 1; starts <= 3; ++starts) {
+    for (uint16_t divisions = 61; divisions < 400; divisions += 37) {
+      config.hob_starts = starts;
+      config.rotary_divisions = divisions;
+      const auto hr = config.calculate_hobbing_ratio();
+      if (!Configuration::verify_ratio(hr)) {
+        continue;
+      }
+      const int32_t start = sim::position;
+      sim::engage<leadscrew>(hr);
+      sim::arm();
+      sim::Line table{hr, start};
+      sim::Spindle spindle(divisions * starts);
+
+      // Hob revolutions per table turn: divisions / starts, in whole turns
+      const uint32_t hob_turns = table_turns * divisions / std::gcd<uint32_t>(divisions, starts);
+      const int32_t end = start + hob_turns * counts_per_rev;
+      while (sim::position < end) {
+        spindle.step();
+        table.check(devices::step_gen::position);
+      }
+      const int32_t turned = devices::step_gen::position;
+      const int32_t expected = config.division_position(hob_turns * starts);
+      ++tested;
+      revolutions += hob_turns;
+      if (!table.exact() || table.error(turned) != 0 || turned != expected) {
+        ++failed;
+        std::printf("%u teeth, %u starts: worst %lld/%lld, %d steps, %d expected\n",
+                divisions, starts, (long long)table.worst, (long long)table.d, turned, expected);
+      }
+      sim::disengage<leadscrew>();
+    }
+  }
+
+  // Indexing: the position of every division (over all turns) is rounded on
+  // its own, one table turn is the exact number of steps
+  config.hob_starts = 1;
+  for (uint16_t divisions = 1; divisions < 400; ++divisions) {
+    config.rotary_divisions = divisions;
+    const int32_t turn = config.division_position(divisions);
+    for (uint32_t d = 0; d <= table_turns * divisions; ++d) {
+      const int32_t at = config.division_position(d);
+      const int32_t within = config.division_position(d % divisions);
+      if (at != int32_t(d / divisions) * turn + within) {
+        ++failed;
+        std::printf("%u divisions: division %u at %d\n", divisions, d, at);
+        break;
+      }
+    }
+  }
+
+  std::printf("hobbing: %d setups over %llu hob revolutions, %d off the line\n",
+          tested, (unsigned long long)revolutions, failed);
+  return (failed == 0 && tested > 0) ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+// NCO against the compare triggered gear (the two pointers of the jump
+// range): step timing jitter on the same spindle. The spindle turns at 600
+// rpm with a slow 5% speed swing (cutting load) and 1% noise on the count
+// intervals. A step is due where the input reaches its line (both aim
+// there). The gear steps on the count after the half step crossing plus the
+// phase delay, the NCO at the end of a timer period. Both are measured
+// against the crossing, without their constant offset. At the extreme ratios
+// the NCO has to beat the gear, that is what it is for.
+
+#include <cmath>
+#include <vector>
+
+#include "sim.hpp"
+#include "nco.hpp"
+
+namespace {
+  constexpr double cpu_hz = 72e6;
+  constexpr unsigned tick_div = 72;  // step timer in NCO mode (TimedClockDiv)
+  constexpr unsigned clock_div = 2;  // step timer when triggered
+  constexpr unsigned min_count = 5;  // mcu::min_timer_capture_count
+  constexpr int32_t counts_per_rev = 2400;
+
+  struct Ratio {
+    int n, d;
+    int numerator() const { return n; }
+    int denominator() const { return d; }
+  };
+
+  // Count times (CPU ticks) and the input period TIM2 gives at every count:
+  // a period of channel A (4 counts) over the prescaler of 4
+  struct Input {
+    std::vector<double> at;
+    std::vector<uint16_t> period;
+
+    explicit Input(double seconds) {
+      std::mt19937 random(1);
+      std::normal_distribution<double> noise(0, 0.01);
+      const double rate = 600.0 / 60 * counts_per_rev; // counts/s
+      double t = 0;
+      uint16_t latched = 0;
+      while (t < seconds * cpu_hz) {
+        const double speed = 1 + 0.05 * std::sin(2 * M_PI * 2 * t / cpu_hz);
+        t += cpu_hz / (rate * speed) * (1 + noise(random));
+        at.push_back(t);
+        const size_t i = at.size() - 1;
+        if (i >= 4 && (i % 4) == 0) {
+          latched = static_cast<uint16_t>(std::min((at[i] - at[i - 4]) / 4, 65535.0));
+        }
+        period.push_back(latched);
+      }
+    }
+
+    // Time the input is at `position` (counts), within a count linearly
+    double time_at(double position) const {
+      const size_t i = static_cast<size_t>(position);
+      if (i + 1 >= at.size()) {
+        return at.back();
+      }
+      return at[i] + (position - i) * (at[i + 1] - at[i]);
+    }
+  };
+
+  struct Jitter {
+    std::vector<double> deviation; // step time - crossing time, CPU ticks
+
+    void add(double step, double due) { deviation.push_back(step - due); }
+
+    double mean() const {
+      double sum = 0;
+      for (double x : deviation) sum += x;
+      return sum / deviation.size();
+    }
+
+    // Around the mean, in microseconds
+    double peak_to_peak() const {
+      const auto [lo, hi] = std::minmax_element(deviation.begin(), deviation.end());
+      return 1e6 * (*hi - *lo) / cpu_hz;
+    }
+
+    double rms() const {
+      const double m = mean();
+      double sq = 0;
+      for (double x : deviation) sq += (x - m) * (x - m);
+      return 1e6 * std::sqrt(sq / deviation.size()) / cpu_hz;
+    }
+
+    void print(const char* name) const {
+      std::printf("    %-5s %7zu steps, jitter %7.2f us p-p, %6.2f us rms\n", name,
+              deviation.size(), peak_to_peak(), rms());
+    }
+  };
+
+  // Line of output step k: N * input = D * k
+  double due(const Input& input, const Ratio& r, int32_t k) {
+    return input.time_at(double(k) * r.d / r.n);
+  }
+
+  // Gear: the step goes at the count of the jump plus the delay set for it
+  // when the jump was computed (timer ticks at CPU / 2)
+  Jitter run_gear(const Input& input, const Ratio& r, size_t settle) {
+    using engine = gear::Engine<0>;
+    engine::configure(r, 0);
+    auto& range = engine::range;
+    Jitter jitter;
+    unsigned delay = 0;
+    int32_t output = 0;
+    for (size_t i = 0; i < input.at.size(); ++i) {
+      const gear::Count count = i;
+      if (range.next.count != count) {
+        continue;
+      }
+      engine::take(range.next);
+      ++output;
+      if (i > settle) {
+        jitter.add(input.at[i] + delay, due(input, r, output));
+      }
+      range.next_jump(false, count);
+      unsigned ticks = engine::phase_delay(input.period[i], range.next.error, 0xFFFF * clock_div) / clock_div;
+      delay = (ticks >= min_count) ? ticks * clock_div : 0;
+    }
+    return jitter;
+  }
+
+  // NCO: periods of the free running timer, the next but one is set at the
+  // end of each (preload). The compare interrupt observes counts in between
+  // (it preempts the step interrupt), on a cycle counter that wraps.
+  Jitter run_nco(const Input& input, const Ratio& r, size_t settle) {
+    constexpr uint32_t offset = 0xF0000000;
+    nco::Loop loop;
+    loop.start(r.d, r.n, 0, 0, 0, tick_div, offset);
+    Jitter jitter;
+    nco::Next running{nco::Loop::poll_period, false}, preloaded = running;
+    double t = 0;
+    int32_t output = 0;
+    size_t observed = 1; // armed at the engagement
+    while (true) {
+      const double end = t + double(running.period) * tick_div;
+      while (observed < input.at.size() && input.at[observed] <= end) {
+        observed = loop.observe(observed, offset + static_cast<uint32_t>(std::lround(input.at[observed])));
+      }
+      if (observed >= input.at.size()) {
+        break;
+      }
+      t = end;
+      if (running.pulse) {
+        ++output;
+        if (t > input.at[settle]) {
+          jitter.add(t, due(input, r, output));
+        }
+      }
+      running = preloaded;
+      preloaded = loop.update(output);
+    }
+    return jitter;
+  }
+}
+
+int main() {
+  const Input input(4.0);
+  const size_t settle = input.at.size() / 8;
+  const Ratio ratios[] = {{2, 3}, {1, 8}, {1, 60}, {1, 500}};
+  std::printf("nco: step timing at 600 rpm, %zu counts\n", input.at.size());
+  int failed = 0;
+  for (const auto& r : ratios) {
+    std::printf("  %d/%d\n", r.n, r.d);
+    const auto g = run_gear(input, r, settle);
+    const auto n = run_nco(input, r, settle);
+    g.print("gear");
+    n.print("nco");
+    // Same steps: the NCO stays locked on the line
+    if (n.deviation.size() + 1 < g.deviation.size() || n.deviation.size() > g.deviation.size() + 1) {
+      ++failed;
+    }
+    if (r.d >= 60 * r.n && !(n.peak_to_peak() < g.peak_to_peak())) {
+      ++failed;
+    }
+  }
+  return failed;
+}
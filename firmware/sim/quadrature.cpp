@@ -0,0 +1,62 @@
+// Quadrature output: highest edge rate the one-pulse step timer keeps up
+// with. An edge goes at the phase delay after the trigger, the timer runs on
+// for the edge separation (step_pulse_ns) and the update interrupt arms the
+// next edge. A trigger before that is lost. The input speed is raised until
+// an edge is lost, for ratios from about one edge per count down to one per
+// four counts.
+
+#include "sim.hpp"
+
+namespace {
+  // quadrature_generator at 72 MHz with the default step_pulse_ns (1200):
+  // the timer counts at 36 MHz, the edge is at least one tick after the
+  // trigger and the update counts_edge ticks after the edge
+  constexpr unsigned cpu_mhz = 72, clock_div = 2, step_pulse_ns = 1200;
+  constexpr unsigned counts_edge = 1 + step_pulse_ns * (cpu_mhz / clock_div) / 1000;
+  constexpr unsigned latency = 18; // update interrupt entry and re-arm, CPU ticks
+  constexpr unsigned busy = (1 + counts_edge) * clock_div + latency;
+
+  struct Ratio {
+    long n, d;
+    long numerator() const { return n; }
+    long denominator() const { return d; }
+  };
+
+  // Edges lost over `counts` at the input period (CPU ticks)
+  int32_t lost_at(const Ratio& ratio, uint16_t period, int32_t counts) {
+    using namespace axes;
+    using step_gen = devices::step_gen;
+    sim::input_period = period;
+    sim::engage<leadscrew>(ratio);
+    sim::arm();
+    step_gen::busy = busy;
+    step_gen::ready_at = 0;
+    step_gen::lost = 0;
+    const int32_t end = sim::position + counts;
+    while (sim::position < end) {
+      sim::turn(1);
+    }
+    sim::disengage<leadscrew>();
+    return step_gen::lost;
+  }
+}
+
+int main() {
+  const Ratio ratios[] = {{2399, 2400}, {7, 8}, {2, 3}, {1, 2}, {1, 4}};
+  const double bound = 1e3 * cpu_mhz / busy; // kHz, one edge per busy time
+  std::printf("quadrature: edge separation %u ns, timer busy %.0f ns per edge, %.0f kHz without delay\n",
+          step_pulse_ns, 1e3 * busy / cpu_mhz, bound);
+
+  int failed = 0;
+  for (const auto& r : ratios) {
+    uint16_t period = 1000;
+    while (period > 1 && lost_at(r, period - 1, 50000) == 0) {
+      --period;
+    }
+    const double rate = 1e3 * cpu_mhz * r.n / (double(period) * r.d); // kHz
+    std::printf("  %ld/%ld: %.0f kHz edges (%.0f kHz A/B cycle) at %.0f kHz input\n",
+            r.n, r.d, rate, rate / 4, 1e3 * cpu_mhz / period);
+    failed += (rate > bound) ? 1 : 0; // cannot be faster than the timer
+  }
+  return failed;
+}
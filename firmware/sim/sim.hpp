@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "axes.hpp" // and the staged devices.hpp
+
+// Helpers shared by the host simulations. Every simulation prints what it
+// measured and returns non-zero if a check failed.
+namespace sim {
+
+  // CC interrupt, served as soon as a compare matches
+  inline void serve() {
+    while (cc3_flag || cc4_flag) {
+      ++interrupts;
+      axes::all::process_cc_interrupt();
+    }
+  }
+
+  // Engages an axis at the current position with zero error, the way
+  // configure_gear() and the phase engagement leave it
+  template <typename Axis, typename Ratio>
+  void engage(const Ratio& ratio) {
+    Axis::gear::configure(ratio, static_cast<gear::Count>(position));
+    Axis::gear::state.output_position = 0;
+    Axis::position = 0;
+    Axis::step_gen::position = 0;
+    Axis::step_gen::change_direction(false);
+    Axis::enabled = true;
+  }
+
+  template <typename Axis>
+  void disengage() {
+    Axis::enabled = false;
+  }
+
+  inline void arm() {
+    axes::all::update_channels(static_cast<gear::Count>(position));
+  }
+
+  // Distance of an output from its exact line N / D * (input - start), in
+  // units of 1 / D steps
+  struct Line {
+    int64_t n, d;
+    int32_t start;
+    int64_t worst = 0;
+
+    template <typename Ratio>
+    Line(const Ratio& ratio, int32_t start)
+      : n(ratio.numerator()), d(ratio.denominator()), start(start) {}
+
+    int64_t error(int32_t output) const {
+      return n * (int64_t(position) - start) - d * output;
+    }
+
+    void check(int32_t output) {
+      worst = std::max<int64_t>(worst, std::llabs(error(output)));
+    }
+
+    // Half a step, plus the slope of one count as steps are made on counts
+    bool exact() const {
+      return 2 * worst <= d + 2 * n;
+    }
+  };
+
+  // Spindle turning one way with short reversals (cutting load, an operator
+  // rocking the chuck), `reversal` is the chance per count in 1/65536
+  struct Spindle {
+    std::mt19937 random;
+    unsigned reversal;
+    int direction = 1;
+    unsigned back = 0;
+
+    explicit Spindle(unsigned seed, unsigned reversal = 64) : random(seed), reversal(reversal) {}
+
+    void step() {
+      if (back > 0) {
+        --back;
+        turn(-direction);
+        return;
+      }
+      if ((random() & 0xFFFF) < reversal) {
+        back = 1 + random() % 64;
+      }
+      turn(direction);
+    }
+  };
+
+}
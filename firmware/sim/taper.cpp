@@ -0,0 +1,54 @@
+// Taper threading: leadscrew and cross slide geared to the same encoder over
+// the whole length of a long pass, for every pitch of the list that takes the
+// taper. Both outputs have to stay within half a step of their exact lines
+// at every count, so the diameter follows the thread exactly.
+
+#include "sim.hpp"
+#include "configuration.hpp"
+
+int main() {
+  using namespace axes;
+  Configuration config;
+  config.taper = {1, 16}; // NPT
+  const Configuration::Rational length{200}; // mm of carriage travel
+
+  int failed = 0, tested = 0;
+  for (int16_t i = 0; i < threads::pitch_list_size; ++i) {
+    config.select_thread(i);
+    // Engaged unscaled here (see sim::engage), the terms are checked as such
+    auto unscaled = [](int, int, int32_t) { return 1; };
+    if (config.verify_thread(i, unscaled) != Configuration::thread_OK || !config.use_taper()) {
+      continue;
+    }
+    const auto pr = config.calculate_ratio();
+    const auto cr = config.calculate_cross_ratio();
+    const int32_t start = sim::position;
+    sim::engage<leadscrew>(pr);
+    sim::engage<cross_slide>(cr);
+    sim::arm();
+    sim::Line lead{pr, start}, cross{cr, start};
+
+    // Counts for the length: steps over the leadscrew ratio
+    const int64_t steps = config.length_to_steps(length);
+    const int64_t counts = steps * pr.denominator() / pr.numerator();
+    sim::Spindle spindle(i);
+    while (sim::position - start < counts) {
+      spindle.step();
+      lead.check(devices::step_gen::position);
+      cross.check(devices::step_gen2::position);
+    }
+    ++tested;
+    if (!lead.exact() || !cross.exact()) {
+      ++failed;
+      std::printf("%.*s: leadscrew %lld/%lld, cross slide %lld/%lld (worst error / D)\n",
+              int(config.thread.pitch.pitch_str.size()), config.thread.pitch.pitch_str.data(),
+              (long long)lead.worst, (long long)lead.d,
+              (long long)cross.worst, (long long)cross.d);
+    }
+    sim::disengage<leadscrew>();
+    sim::disengage<cross_slide>();
+  }
+  std::printf("taper: %d pitches over %u mm, %d off the line, %u interrupts\n",
+          tested, length.numerator(), failed, sim::interrupts);
+  return (failed == 0 && tested > 0) ? 0 : 1;
+}
@@ -26,7 +26,8 @@ namespace threads {
     {"M6 ", 1.00_mm},
     {"M8 ", 1.25_mm},
     {"M10", 1.50_mm},
-    {"M12", 1.75_mm}
+    {"M12", 1.75_mm},
+    {"Tr8 P1", 2.00_mm, false, 2} // 2 starts
   };
 
   const int16_t pitch_list_size = std::extent<decltype(pitch_list)>::value;
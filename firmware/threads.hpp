@@ -41,6 +41,7 @@ namespace threads {
     std::string_view name;
     pitch_info pitch;
     bool is_custom{false};
+    uint8_t starts{1}; // multi-start thread: pitch is the lead (advance per revolution)
     
     char * description_c_str(char *buf) const {
       buf = std::copy(name.begin(), name.end(), buf);
@@ -48,6 +49,16 @@ namespace threads {
       buf = std::copy(pitch.pitch_str.begin(), pitch.pitch_str.end(), buf);
       auto unit = pitch.unit();
       buf = std::copy(unit.begin(), unit.end(), buf);
+      if (starts > 1) {
+        *buf++ = 'x';
+        if (starts >= 100) {
+          *buf++ = '0' + starts / 100;
+        }
+        if (starts >= 10) {
+          *buf++ = '0' + starts / 10 % 10;
+        }
+        *buf++ = '0' + starts % 10;
+      }
       if (is_custom) {
         *buf++ = '*';
       }